@@ -0,0 +1,111 @@
+#include "AsyncSocket.h"
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace
+{
+[[noreturn]] void throw_errno(char const *what)
+{
+    std::array<char, 1024> buf;
+    std::snprintf(buf.data(), buf.size(), "%s: %s", what, strerror(errno));
+    throw std::runtime_error(buf.data());
+}
+
+bool would_block(int error) { return error == EAGAIN or error == EWOULDBLOCK; }
+} // namespace
+
+AsyncSocket::AsyncSocket(Reactor &reactor, int fd) : reactor(reactor)
+{
+    this->fd = fd;
+    int const flags = fcntl(fd, F_GETFL);
+    if (flags == -1 or fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        close(fd);
+        throw_errno("fcntl O_NONBLOCK");
+    }
+    try
+    {
+        reactor.add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, *this);
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+}
+
+AsyncSocket::~AsyncSocket()
+{
+    reactor.remove(fd);
+    if (close(fd) == -1)
+        perror("close socket: ");
+}
+
+std::unique_ptr<Task> AsyncSocket::handle(Executor &executor,
+                                          uint32_t active_events)
+{
+    // Errors and hangups are reported to both directions, whose next attempt
+    // then fails or returns 0
+    uint32_t const failed = EPOLLERR | EPOLLHUP;
+    if (active_events & (EPOLLIN | EPOLLRDHUP | failed))
+        read_waker.wake_one(executor, Priority::latency_critical);
+    if (active_events & (EPOLLOUT | failed))
+        write_waker.wake_one(executor, Priority::latency_critical);
+    return nullptr;
+}
+
+bool AsyncSocket::ReadAwaitable::try_complete()
+{
+    while (true)
+    {
+        bytes_read = ::read(socket.fd, buffer.data(), buffer.size());
+        if (bytes_read != -1)
+            return true;
+        if (errno == EINTR)
+            continue;
+        if (would_block(errno))
+            return false;
+        bytes_read = -errno;
+        return true;
+    }
+}
+
+bool AsyncSocket::WriteAwaitable::try_complete()
+{
+    while (true)
+    {
+        bytes_written =
+            ::send(socket.fd, buffer.data(), buffer.size(), MSG_NOSIGNAL);
+        if (bytes_written != -1)
+            return true;
+        if (errno == EINTR)
+            continue;
+        if (would_block(errno))
+            return false;
+        bytes_written = -errno;
+        return true;
+    }
+}
+
+bool AsyncSocket::AcceptAwaitable::try_complete()
+{
+    while (true)
+    {
+        accepted_fd = ::accept4(socket.fd, address, address_length,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (accepted_fd != -1)
+            return true;
+        if (errno == EINTR)
+            continue;
+        if (would_block(errno))
+            return false;
+        accepted_fd = -errno;
+        return true;
+    }
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include "Reactor.h"
+#include "Task.h"
+#include "Waker.h"
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// A nonblocking socket whose operations are WakerAwaitables, e.g.
+//     ssize_t n = co_await socket.read(buffer);
+// The socket is registered with the reactor once, edge-triggered, and is its
+// own Handler: readiness wakes the coroutine parked on the socket instead of
+// spawning a task per event. Every operation first tries the system call and
+// only parks on EAGAIN, so no edge is lost. Results are a byte count (or the
+// accepted fd), or -errno on failure.
+// At most one reader (read or accept) and one writer may wait at a time.
+class AsyncSocket final : public Handler
+{
+    Reactor &reactor;
+    ReusableSingleTaskWaker read_waker;
+    ReusableSingleTaskWaker write_waker;
+
+public:
+    class ReadAwaitable
+    {
+        AsyncSocket &socket;
+        std::span<std::byte> buffer;
+        ssize_t bytes_read = 0;
+
+    public:
+        ReadAwaitable(AsyncSocket &socket, std::span<std::byte> buffer)
+            : socket(socket), buffer(buffer)
+        {
+        }
+        bool try_complete();
+        Waker &waker() { return socket.read_waker; }
+        ssize_t result() const { return bytes_read; }
+    };
+
+    class WriteAwaitable
+    {
+        AsyncSocket &socket;
+        std::span<std::byte const> buffer;
+        ssize_t bytes_written = 0;
+
+    public:
+        WriteAwaitable(AsyncSocket &socket, std::span<std::byte const> buffer)
+            : socket(socket), buffer(buffer)
+        {
+        }
+        bool try_complete();
+        Waker &waker() { return socket.write_waker; }
+        ssize_t result() const { return bytes_written; }
+    };
+
+    class AcceptAwaitable
+    {
+        AsyncSocket &socket;
+        sockaddr *address;
+        socklen_t *address_length;
+        int accepted_fd = -1;
+
+    public:
+        AcceptAwaitable(AsyncSocket &socket, sockaddr *address,
+                        socklen_t *address_length)
+            : socket(socket), address(address), address_length(address_length)
+        {
+        }
+        bool try_complete();
+        Waker &waker() { return socket.read_waker; }
+        // The accepted socket is nonblocking, ready to be wrapped in an
+        // AsyncSocket
+        int result() const { return accepted_fd; }
+    };
+
+    // Takes ownership of fd and makes it nonblocking
+    AsyncSocket(Reactor &reactor, int fd);
+    AsyncSocket(AsyncSocket const &) = delete;
+    ~AsyncSocket();
+
+    std::unique_ptr<Task> handle(Executor &executor,
+                                 uint32_t active_events) override;
+
+    int get_fd() const { return fd; }
+    // Reads at most buffer.size() bytes directly into buffer
+    ReadAwaitable read(std::span<std::byte> buffer) { return {*this, buffer}; }
+    // Writes at most buffer.size() bytes
+    WriteAwaitable write(std::span<std::byte const> buffer)
+    {
+        return {*this, buffer};
+    }
+    AcceptAwaitable accept(sockaddr *address = nullptr,
+                           socklen_t *address_length = nullptr)
+    {
+        return {*this, address, address_length};
+    }
+};
@@ -0,0 +1,43 @@
+#pragma once
+#include "Rc.h"
+#include <utility>
+
+// Shared flag through which a tree of tasks is cancelled.
+// A task that has a token passes it on to the child tasks it spawns, to its
+// daemons and to the subtasks of an IndependentTasks, unless they have a token
+// of their own. A token made from a parent token is cancelled along with it,
+// so a subtree can be cancelled on its own or with the whole tree.
+// Executor::cancel destroys the sleeping tasks of a cancelled tree right away,
+// after unlinking them from their wakers and timers, and the executor drops
+// the queued ones instead of stepping them. A task waiting for its children is
+// destroyed once they are. Cancelled tasks are not stepped again, so they only
+// release what their destructors release: a cancelled coroutine does not run
+// past its current co_await. An io_uring operation it was waiting on is
+// cancelled in the kernel as it is destroyed, but a Mutex it holds stays
+// locked unless it holds it through a Mutex::Guard. A task that a FifoWaker
+// woke but that is cancelled before it runs passes the wake on to the next
+// waiter, so a mutex or notify_one is not lost with it.
+// A child that is cancelled leaves no return value, so a coroutine awaiting
+// one gets an exception instead, or a null pointer for a boxed value.
+class CancellationToken final : public RcCounted<CancellationToken>
+{
+    Rc<CancellationToken> parent;
+    bool cancelled = false;
+
+public:
+    CancellationToken() = default;
+    explicit CancellationToken(Rc<CancellationToken> parent)
+        : parent(std::move(parent))
+    {
+    }
+    bool is_cancelled() const
+    {
+        for (CancellationToken const *token = this; token != nullptr;
+             token = token->parent.get())
+            if (token->cancelled)
+                return true;
+        return false;
+    }
+    // Only marks the token. Tasks can poll is_cancelled() to stop early.
+    void cancel() { cancelled = true; }
+};
@@ -0,0 +1,122 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+// Chase-Lev work-stealing deque, with the memory orderings from
+// Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models".
+// The owning thread pushes and pops at the bottom, any thread may steal from
+// the top. T should be a trivially copyable handle such as a raw pointer.
+template <typename T>
+class ChaseLevDeque
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+
+    struct Buffer
+    {
+        std::int64_t const capacity; // power of 2
+        std::unique_ptr<std::atomic<T>[]> slots;
+        explicit Buffer(std::int64_t capacity)
+            : capacity(capacity), slots(new std::atomic<T>[capacity])
+        {
+        }
+        T load(std::int64_t i) const
+        {
+            return slots[i & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+        void store(std::int64_t i, T value)
+        {
+            slots[i & (capacity - 1)].store(value, std::memory_order_relaxed);
+        }
+    };
+
+    alignas(64) std::atomic<std::int64_t> top{0};
+    alignas(64) std::atomic<std::int64_t> bottom{0};
+    std::atomic<Buffer *> buffer;
+    // Buffers are only freed together with the deque, since a thief may still
+    // be reading from a buffer that the owner has just outgrown.
+    std::vector<std::unique_ptr<Buffer>> buffers;
+
+    Buffer *grow(Buffer *old_buffer, std::int64_t b, std::int64_t t)
+    {
+        auto &new_buffer = buffers.emplace_back(
+            std::make_unique<Buffer>(old_buffer->capacity * 2));
+        for (std::int64_t i = t; i < b; ++i)
+            new_buffer->store(i, old_buffer->load(i));
+        buffer.store(new_buffer.get(), std::memory_order_release);
+        return new_buffer.get();
+    }
+
+public:
+    explicit ChaseLevDeque(std::int64_t capacity = 256)
+    {
+        buffers.push_back(std::make_unique<Buffer>(capacity));
+        buffer.store(buffers.back().get(), std::memory_order_relaxed);
+    }
+    ChaseLevDeque(ChaseLevDeque const &) = delete;
+
+    // Owner only
+    void push(T value)
+    {
+        std::int64_t const b = bottom.load(std::memory_order_relaxed);
+        std::int64_t const t = top.load(std::memory_order_acquire);
+        Buffer *a = buffer.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1)
+            a = grow(a, b, t);
+        a->store(b, value);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // Owner only
+    std::optional<T> pop()
+    {
+        std::int64_t const b = bottom.load(std::memory_order_relaxed) - 1;
+        Buffer *a = buffer.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b)
+        {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+        T value = a->load(b);
+        if (t == b)
+        {
+            // Last element, race against thieves for it
+            bool const won = top.compare_exchange_strong(
+                t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            if (not won)
+                return std::nullopt;
+        }
+        return value;
+    }
+
+    // Any thread. May fail spuriously when racing with another thief.
+    std::optional<T> steal()
+    {
+        std::int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t const b = bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return std::nullopt;
+        Buffer *a = buffer.load(std::memory_order_acquire);
+        T value = a->load(t);
+        if (not top.compare_exchange_strong(t, t + 1,
+                                            std::memory_order_seq_cst,
+                                            std::memory_order_relaxed))
+            return std::nullopt;
+        return value;
+    }
+
+    bool empty() const
+    {
+        return bottom.load(std::memory_order_relaxed) <=
+               top.load(std::memory_order_relaxed);
+    }
+};
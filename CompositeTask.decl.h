@@ -1 +1,5 @@
-enum class SubtaskStatus;
+#pragma once
+#include <cstdint>
+
+enum class SubtaskStatus : uint8_t;
+class SubtaskGroup;
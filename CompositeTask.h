@@ -1,8 +1,15 @@
+#pragma once
 #include "StepResult.h"
 #include "Task.h"
 #include "Waker.h"
+#include <array>
+#include <bit>
 #include <cstddef>
+#include <cstdint>
+#include <optional>
 #include <stdexcept>
+#include <tuple>
+#include <utility>
 #include <variant>
 
 template <typename TaskT, typename... OtherTaskT>
@@ -15,15 +22,13 @@ struct ConcatTask final : public Task
           other_tasks(ConcatTask<OtherTaskT...>(std::move(other_tasks)...))
     {
     }
-    StepResult step_with_result(
-        SingleThreadedExecutor &executor,
-        std::vector<std::optional<std::unique_ptr<void, TypeErasedDeleter>>>
-            child_return_values) override
+    StepResult step_with_result(Executor &executor,
+                                ChildReturnValues child_return_values) override
     {
         if (task)
         {
             StepResult result = task->step_with_result(
-                executor, std::move(child_return_values));
+                executor, child_return_values);
             if (step_result::Done *done =
                     std::get_if<step_result::Done>(&result))
             {
@@ -54,7 +59,7 @@ struct ConcatTask final : public Task
         else
         {
             return other_tasks.step_with_result(executor,
-                                                std::move(child_return_values));
+                                                child_return_values);
         }
     }
 };
@@ -64,128 +69,197 @@ struct ConcatTask<TaskT> final : public Task
 {
     TaskT task;
     ConcatTask(TaskT &&task) : task(std::move(task)) {}
-    StepResult step_with_result(
-        SingleThreadedExecutor &executor,
-        std::vector<std::optional<std::unique_ptr<void, TypeErasedDeleter>>>
-            child_return_values) override
+    StepResult step_with_result(Executor &executor,
+                                ChildReturnValues child_return_values) override
     {
-        return task.step_with_result(executor, std::move(child_return_values));
+        return task.step_with_result(executor, child_return_values);
     }
 };
 
-enum class SubtaskStatus
+enum class SubtaskStatus : uint8_t
 {
     ready,
     waiting,
     done,
 };
-template <typename TaskT>
-struct TaskWithStatus
+
+// The part of an IndependentTasks group through which the executor reports
+// that a waiting subtask can run again. Groups nested in other groups link to
+// their parent, so waking a subtask marks it ready on every level up to the
+// outermost group.
+class SubtaskGroup
 {
-    TaskT task;
-    SubtaskStatus status = SubtaskStatus::ready;
-    TaskWithStatus(TaskT task) : task(std::move(task)) {}
+    SubtaskGroup *parent_group = nullptr;
+    size_t index_in_parent_group = 0;
+
+protected:
+    // The one waker of the group, which sleeps on it while no subtask is ready
+    ReusableSingleTaskWaker group_waker;
+
+    // With done, the subtask has finished in its wait
+    virtual void mark_ready(size_t index, bool done) = 0;
+
+public:
+    void set_parent_group(SubtaskGroup &group, size_t index)
+    {
+        parent_group = &group;
+        index_in_parent_group = index;
+    }
+    void wake_subtask(Executor &executor, size_t index, bool done)
+    {
+        for (SubtaskGroup *group = this; group != nullptr;
+             index = group->index_in_parent_group, group = group->parent_group)
+        {
+            group->mark_ready(index, done);
+            done = false;
+            if (group->group_waker.has_waiters())
+                group->group_waker.wake_one(executor);
+        }
+    }
 };
 
-template <typename TaskT, typename... OtherTasks>
-struct IndependentTasks final : public Task
+// Runs its subtasks concurrently and finishes once all of them have.
+// The subtasks live in one tuple, their statuses in one array, and the ready
+// ones in a bitmask of 64-bit words, so a step goes straight to the next ready
+// subtask in round-robin order, a word at a time, and a wait costs the same
+// however many subtasks there are.
+template <typename... TaskTs>
+struct IndependentTasks final : public Task, public SubtaskGroup
 {
-    ReusableSingleTaskWaker self_waker;
-    std::optional<TaskWithStatus<TaskT>> task_with_status;
-    IndependentTasks<OtherTasks...> other_tasks;
-    IndependentTasks(TaskT task, OtherTasks... other_tasks)
-        : Task("IndependentTasks"),
-          task_with_status(TaskWithStatus<TaskT>(std::move(task))),
-          other_tasks(
-              IndependentTasks<OtherTasks...>(std::move(other_tasks)...))
+    static constexpr size_t number_of_subtasks = sizeof...(TaskTs);
+    static_assert(number_of_subtasks >= 1);
+    static constexpr size_t number_of_mask_words =
+        (number_of_subtasks + 63) / 64;
+
+    std::tuple<std::optional<TaskTs>...> subtasks;
+    std::array<SubtaskStatus, number_of_subtasks> statuses;
+    // Bit i % 64 of word i / 64 is set while subtask i is ready to be stepped
+    std::array<uint64_t, number_of_mask_words> ready_mask;
+    size_t number_of_unfinished_subtasks = number_of_subtasks;
+    // Where the search for the next ready subtask starts
+    size_t next_subtask = 0;
+
+    IndependentTasks(TaskTs... tasks)
+        : Task("IndependentTasks"), subtasks(std::move(tasks)...)
+    {
+        statuses.fill(SubtaskStatus::ready);
+        ready_mask.fill(~uint64_t(0));
+        if (number_of_subtasks % 64 != 0)
+            ready_mask.back() >>= 64 - number_of_subtasks % 64;
+    }
+
+    StepResult step_with_result(Executor &executor,
+                                ChildReturnValues child_return_values) override
     {
+        if (not any_ready())
+            return step_result::Wait(step_result::Wait::task_not_done,
+                                     group_waker);
+        size_t const index = next_ready(next_subtask);
+        next_subtask = (index + 1) % number_of_subtasks;
+        static constexpr auto steppers =
+            make_steppers(std::index_sequence_for<TaskTs...>());
+        return (this->*steppers[index])(executor, child_return_values);
     }
 
-    StepResult step_with_result(
-        SingleThreadedExecutor &executor,
-        std::vector<std::optional<std::unique_ptr<void, TypeErasedDeleter>>>
-            child_return_values) override
+private:
+    using Stepper = StepResult (IndependentTasks::*)(Executor &,
+                                                     ChildReturnValues);
+    template <size_t... Is>
+    static constexpr std::array<Stepper, number_of_subtasks>
+    make_steppers(std::index_sequence<Is...>)
     {
+        return {&IndependentTasks::step_subtask<Is>...};
+    }
 
-        if (task_with_status)
+    bool any_ready() const
+    {
+        for (uint64_t word : ready_mask)
+            if (word != 0)
+                return true;
+        return false;
+    }
+
+    // The first ready subtask from start on, wrapping around. One must be
+    // ready.
+    size_t next_ready(size_t start) const
+    {
+        size_t word = start / 64;
+        uint64_t bits = ready_mask[word] & (~uint64_t(0) << start % 64);
+        // Back at the first word, its bits below start are included
+        while (bits == 0)
         {
-            SubtaskStatus &status = task_with_status->status;
-            switch (status)
-            {
-            case SubtaskStatus::ready:
-            {
-                TaskT &task = task_with_status->task;
-                StepResult result = task.step_with_result(
-                    executor, std::move(child_return_values));
-                if (step_result::Done *done =
-                        std::get_if<step_result::Done>(&result))
-                {
-                    task_with_status = std::nullopt;
-                    return step_result::Ready(std::move(done->child_tasks));
-                }
-                else if (step_result::Ready *ready =
-                             std::get_if<step_result::Ready>(&result))
-                {
-                    // implicitly movable entity
-                    return result;
-                }
-                else if (step_result::Wait *wait =
-                             std::get_if<step_result::Wait>(&result))
-                {
-                    status = SubtaskStatus::waiting;
-                    return step_result::CompositeWait(false, self_waker, status,
-                                                      std::move(*wait));
-                }
-                else if (step_result::CompositeWait *composite_wait =
-                             std::get_if<step_result::CompositeWait>(&result))
-                {
-                    if (composite_wait->all_subtasks_sleeping)
-                        status = SubtaskStatus::waiting;
-                    return step_result::CompositeWait(
-                        false, self_waker, status, std::move(*composite_wait));
-                }
-                else
-                {
-                    throw std::runtime_error("Unhandled");
-                }
-                break;
-            }
-            case SubtaskStatus::waiting:
-            {
-                break;
-            }
-            case SubtaskStatus::done:
-            {
-                task_with_status = std::nullopt;
-                break;
-            }
-            }
+            word = (word + 1) % number_of_mask_words;
+            bits = ready_mask[word];
         }
+        return word * 64 + std::countr_zero(bits);
+    }
+
+    void mark_ready(size_t index, bool done) override
+    {
+        statuses[index] = done ? SubtaskStatus::done : SubtaskStatus::ready;
+        ready_mask[index / 64] |= uint64_t(1) << index % 64;
+    }
+
+    void mark_waiting(size_t index)
+    {
+        statuses[index] = SubtaskStatus::waiting;
+        ready_mask[index / 64] &= ~(uint64_t(1) << index % 64);
+    }
+
+    StepResult finish_subtask(size_t index,
+                              std::vector<std::unique_ptr<Task>> child_tasks)
+    {
+        statuses[index] = SubtaskStatus::done;
+        ready_mask[index / 64] &= ~(uint64_t(1) << index % 64);
+        if (--number_of_unfinished_subtasks == 0)
+            return step_result::Done(std::move(child_tasks));
+        return step_result::Ready(std::move(child_tasks));
+    }
 
-        bool const is_first_task_waiting = task_with_status.has_value();
-        bool const is_first_task_done = !is_first_task_waiting;
-        StepResult result = other_tasks.step_with_result(
-            executor, std::move(child_return_values));
+    template <size_t I>
+    StepResult step_subtask(Executor &executor,
+                            ChildReturnValues child_return_values)
+    {
+        auto &subtask = std::get<I>(subtasks);
+        subtask->inherit_from(*this);
+        // Finished by a wait with task_automatically_done, or cancelled
+        if (statuses[I] == SubtaskStatus::done or subtask->is_cancelled())
+        {
+            subtask.reset();
+            return finish_subtask(I, {});
+        }
+        StepResult result =
+            subtask->step_with_result(executor, child_return_values);
         if (step_result::Done *done = std::get_if<step_result::Done>(&result))
         {
-            if (is_first_task_waiting)
-                return step_result::Wait(step_result::Wait::task_not_done, self_waker);
-            else
-                return result;
+            std::vector<std::unique_ptr<Task>> child_tasks =
+                std::move(done->child_tasks);
+            subtask.reset();
+            return finish_subtask(I, std::move(child_tasks));
         }
-        else if (step_result::Ready *ready =
-                     std::get_if<step_result::Ready>(&result))
+        else if (std::holds_alternative<step_result::Ready>(result))
         {
             return result;
         }
-        else if (step_result::CompositeWait *composite_wait =
-                     std::get_if<step_result::CompositeWait>(&result))
+        else if (step_result::Wait *wait =
+                     std::get_if<step_result::Wait>(&result))
         {
-            return step_result::CompositeWait(self_waker, std::move(*composite_wait));
+            mark_waiting(I);
+            return step_result::CompositeWait(
+                not any_ready(), group_waker, *this, I,
+                subtask->get_cancellation_token(), *this, std::move(*wait));
         }
-        else if (step_result::Wait *null_wait = std::get_if<step_result::Wait>(&result))
+        else if (step_result::CompositeWait *composite_wait =
+                     std::get_if<step_result::CompositeWait>(&result))
         {
-            return step_result::Wait(step_result::Wait::task_not_done, self_waker);
+            if (composite_wait->all_subtasks_sleeping)
+                mark_waiting(I);
+            composite_wait->outermost_group.set_parent_group(*this, I);
+            return step_result::CompositeWait(
+                not any_ready(), group_waker, composite_wait->leaf_group,
+                composite_wait->leaf_index,
+                std::move(composite_wait->leaf_cancellation_token), *this,
+                std::move(composite_wait->wait));
         }
         else
         {
@@ -194,101 +268,10 @@ struct IndependentTasks final : public Task
     }
 };
 
-template <typename TaskT>
-struct IndependentTasks<TaskT> final : public Task
-{
-    ReusableSingleTaskWaker self_waker;
-    std::optional<TaskWithStatus<TaskT>> task_with_status;
-    IndependentTasks(TaskT task)
-        : Task("IndependentTasks"),
-          task_with_status(TaskWithStatus<TaskT>(std::move(task)))
-    {
-    }
-
-    StepResult step_with_result(
-        SingleThreadedExecutor &executor,
-        std::vector<std::optional<std::unique_ptr<void, TypeErasedDeleter>>>
-            child_return_values) override
-    {
-        if (task_with_status)
-        {
-            TaskT &task = task_with_status->task;
-            SubtaskStatus &status = task_with_status->status;
-            switch (status)
-            {
-            case SubtaskStatus::ready:
-            // case SubtaskStatus::waiting:
-            {
-                StepResult result = task.step_with_result(
-                    executor, std::move(child_return_values));
-#ifndef NDEBUG
-                if (status == SubtaskStatus::waiting)
-                {
-                    if (std::holds_alternative<step_result::Wait>(result) or
-                        std::holds_alternative<step_result::CompositeWait>(
-                            result))
-                        ;
-                    else
-                        throw std::runtime_error("Unexpected");
-                }
-#endif
-                if (step_result::Done *done =
-                        std::get_if<step_result::Done>(&result))
-                {
-                    task_with_status = std::nullopt;
-                    return step_result::Done(std::move(done->child_tasks));
-                }
-                else if (step_result::Ready *ready =
-                             std::get_if<step_result::Ready>(&result))
-                {
-                    return result;
-                }
-                else if (step_result::Wait *wait =
-                             std::get_if<step_result::Wait>(&result))
-                {
-                    status = SubtaskStatus::waiting;
-                    return step_result::CompositeWait(true, self_waker, status,
-                                                      std::move(*wait));
-                }
-                else if (step_result::CompositeWait *composite_wait =
-                             std::get_if<step_result::CompositeWait>(&result))
-                {
-                    if (composite_wait->all_subtasks_sleeping)
-                        status = SubtaskStatus::waiting;
-                    return step_result::CompositeWait(
-                        composite_wait->all_subtasks_sleeping, self_waker, status,
-                        std::move(*composite_wait));
-                }
-                else
-                {
-                    throw std::runtime_error("Unhandled");
-                }
-                break;
-            }
-            case SubtaskStatus::done:
-            {
-                task_with_status =
-                    std::nullopt; // TODO: Would this lead to lifetime issues
-                                  // w.r.t references to status?
-                return step_result::Done();
-            }
-            case SubtaskStatus::waiting:
-            {
-                return step_result::Wait(step_result::Wait::task_not_done, self_waker);
-            }
-            }
-        }
-        else
-        {
-            return step_result::Done();
-        }
-    }
-};
-
-template <typename TaskT, typename... OtherTasks>
-std::unique_ptr<IndependentTasks<TaskT, OtherTasks...>>
-make_independent_tasks(TaskT &&task, OtherTasks &&...other_tasks)
+template <typename... TaskTs>
+std::unique_ptr<IndependentTasks<TaskTs...>>
+make_independent_tasks(TaskTs &&...tasks)
 {
-    return std::make_unique<IndependentTasks<TaskT, OtherTasks...>>(
-        std::forward<TaskT>(task), std::forward<OtherTasks>(other_tasks)...);
+    return std::make_unique<IndependentTasks<TaskTs...>>(
+        std::forward<TaskTs>(tasks)...);
 }
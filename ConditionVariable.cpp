@@ -1,14 +1,12 @@
 #include "ConditionVariable.h"
 ConditionVariable::ConditionVariable() : waker(std::make_unique<FifoWaker>()) {}
 
-StepResult ConditionVariableWaitTask::step(SingleThreadedExecutor &executor)
+StepResult ConditionVariableWaitTask::step(Executor &executor)
 {
     switch (stage++)
     {
     case 0:
-        mutex.is_acquired = false;
-        if (mutex.waker->has_waiters())
-            mutex.waker->wake_one(executor);
+        mutex.unlock(executor);
         return step_result::Wait(step_result::Wait::task_not_done,
                                  step_result::WaitForWaker(*cv.waker.get()));
     case 1:
@@ -21,14 +19,33 @@ StepResult ConditionVariableWaitTask::step(SingleThreadedExecutor &executor)
     }
 }
 
-StepResult RcConditionVariableWaitTask::step(SingleThreadedExecutor &executor)
+StepResult TimedConditionVariableWaitTask::step(Executor &executor)
 {
     switch (stage++)
     {
     case 0:
-        mutex->is_acquired = false;
-        if (mutex->waker->has_waiters())
-            mutex->waker->wake_one(executor);
+        mutex.unlock(executor);
+        return step_result::Wait(step_result::Wait::task_not_done, *cv.waker,
+                                 deadline);
+    case 1:
+        notified = not wait_timed_out();
+        return step_result::Wait(
+            step_result::Wait::task_not_done,
+            step_result::WaitForChildTasks(
+                make_vector_unique<Task>(MutexAcquireTask(mutex))));
+    case 2:
+        return done_with(notified);
+    default:
+        throw std::runtime_error("Unreachable");
+    }
+}
+
+StepResult RcConditionVariableWaitTask::step(Executor &executor)
+{
+    switch (stage++)
+    {
+    case 0:
+        mutex->unlock(executor);
         return step_result::Wait(step_result::Wait::task_not_done,
                                  step_result::WaitForWaker(*cv->waker.get()));
     case 1:
@@ -41,7 +58,7 @@ StepResult RcConditionVariableWaitTask::step(SingleThreadedExecutor &executor)
     }
 }
 
-StepResult ConditionVariableNotifyTask::step(SingleThreadedExecutor &executor)
+StepResult ConditionVariableNotifyTask::step(Executor &executor)
 {
     if (cv.waker->has_waiters())
     {
@@ -53,7 +70,7 @@ StepResult ConditionVariableNotifyTask::step(SingleThreadedExecutor &executor)
     return step_result::Done();
 }
 
-StepResult RcConditionVariableNotifyTask::step(SingleThreadedExecutor &executor)
+StepResult RcConditionVariableNotifyTask::step(Executor &executor)
 {
     if (cv->waker->has_waiters())
     {
@@ -68,17 +85,12 @@ StepResult RcConditionVariableNotifyTask::step(SingleThreadedExecutor &executor)
 std::unique_ptr<CoroConditionVariableWaitTask>
 condition_variable_wait_task(Rc<Mutex> mutex, Rc<ConditionVariable> cv)
 {
-
-    mutex->is_acquired = false;
-    if (mutex->waker->has_waiters())
-        mutex->waker->wake_one(co_await executor_awaiter);
+    mutex->unlock(co_await executor_awaiter);
     co_yield step_result::Wait(step_result::Wait::task_not_done,
                                step_result::WaitForWaker(*cv->waker.get()));
 
-    co_yield step_result::Wait(
-        step_result::Wait::task_automatically_done,
-        step_result::WaitForChildTasks(
-            make_vector_unique<Task>(RcMutexAcquireTask(mutex))));
+    co_await mutex->lock();
+    co_yield step_result::Done();
 }
 
 std::unique_ptr<CoroConditionVariableNotifyTask>
@@ -3,6 +3,7 @@
 #include "Mutex.h"
 #include "Rc.h"
 #include "Task.h"
+#include "ValueTask.h"
 #include "Waker.h"
 
 struct ConditionVariable
@@ -22,7 +23,28 @@ public:
         : Task("ConditionVariableWaitTask"), mutex(mutex), cv(cv)
     {
     }
-    StepResult step(SingleThreadedExecutor &) override;
+    StepResult step(Executor &) override;
+};
+
+// Like ConditionVariableWaitTask, but stops waiting for a notification once
+// the deadline passes. The mutex is reacquired either way, and the task
+// returns whether it was notified.
+class TimedConditionVariableWaitTask final : public ValueTask<bool>
+{
+    Mutex &mutex;
+    ConditionVariable &cv;
+    Clock::time_point deadline;
+    unsigned stage = 0;
+    bool notified = false;
+
+public:
+    TimedConditionVariableWaitTask(Mutex &mutex, ConditionVariable &cv,
+                                   Clock::time_point deadline)
+        : ValueTask("TimedConditionVariableWaitTask"), mutex(mutex), cv(cv),
+          deadline(deadline)
+    {
+    }
+    StepResult step(Executor &) override;
 };
 
 class RcConditionVariableWaitTask final : public Task
@@ -37,7 +59,7 @@ public:
           cv(std::move(cv))
     {
     }
-    StepResult step(SingleThreadedExecutor &) override;
+    StepResult step(Executor &) override;
 };
 
 class ConditionVariableNotifyTask final : public Task
@@ -50,7 +72,7 @@ public:
         : Task("ConditionVariableNotifyTask"), notify_all(notify_all), cv(cv)
     {
     }
-    StepResult step(SingleThreadedExecutor &) override;
+    StepResult step(Executor &) override;
 };
 
 class RcConditionVariableNotifyTask final : public Task
@@ -64,7 +86,7 @@ public:
           cv(std::move(cv))
     {
     }
-    StepResult step(SingleThreadedExecutor &) override;
+    StepResult step(Executor &) override;
 };
 
 struct CoroConditionVariableWaitTask;
@@ -72,7 +94,7 @@ struct CoroConditionVariableWaitTaskPromise final
     : PromiseType<CoroConditionVariableWaitTaskPromise,
                   CoroConditionVariableWaitTask>
 {
-    static std::string get_name()
+    static std::string_view get_name()
     {
         return "CoroConditionVariableWaitTaskPromise";
     }
@@ -80,8 +102,8 @@ struct CoroConditionVariableWaitTaskPromise final
 struct CoroConditionVariableWaitTask
     : public CoroutineTask<CoroConditionVariableWaitTaskPromise>
 {
-    CoroConditionVariableWaitTask(std::string name, promise_type &promise)
-        : CoroutineTask(std::move(name), promise)
+    CoroConditionVariableWaitTask(std::string_view name, promise_type &promise)
+        : CoroutineTask(name, promise)
     {
     }
 };
@@ -93,7 +115,7 @@ struct CoroConditionVariableNotifyTaskPromise final
     : PromiseType<CoroConditionVariableNotifyTaskPromise,
                   CoroConditionVariableNotifyTask>
 {
-    static std::string get_name()
+    static std::string_view get_name()
     {
         return "CoroConditionVariableNotifyTaskPromise";
     }
@@ -101,8 +123,9 @@ struct CoroConditionVariableNotifyTaskPromise final
 struct CoroConditionVariableNotifyTask
     : public CoroutineTask<CoroConditionVariableNotifyTaskPromise>
 {
-    CoroConditionVariableNotifyTask(std::string name, promise_type &promise)
-        : CoroutineTask(std::move(name), promise)
+    CoroConditionVariableNotifyTask(std::string_view name,
+                                    promise_type &promise)
+        : CoroutineTask(name, promise)
     {
     }
 };
@@ -1,5 +1,6 @@
 #pragma once
 #include "Executor.decl.h"
+#include "Task.decl.h"
 #include "utilities.h"
 #include <optional>
 template <typename ChildT, typename CoroutineTaskT>
@@ -8,10 +9,9 @@ template <typename PromiseTypeT>
     requires requires(PromiseTypeT promise) {
         {
             promise.most_recent_executor
-        } -> DecaysTo<SingleThreadedExecutor *>;
+        } -> DecaysTo<Executor *>;
         {
             promise.last_child_return_values
-        } -> DecaysTo<std::optional<std::vector<
-            std::optional<std::unique_ptr<void, TypeErasedDeleter>>>>>;
+        } -> DecaysTo<ChildReturnValues>;
     }
 struct CoroutineTask;
\ No newline at end of file
@@ -1,11 +1,15 @@
 #pragma once
+#include "PoolAllocator.h"
 #include "StepResult.h"
 #include "Task.h"
 #include "utilities.h"
 #include <coroutine>
+#include <exception>
 #include <memory>
+#include <optional>
 #include <stdexcept>
-#include <string>
+#include <string_view>
+#include <type_traits>
 #include <utility>
 
 struct Void
@@ -15,17 +19,205 @@ struct ExecutorAwaiter
 {
 };
 static constexpr ExecutorAwaiter executor_awaiter;
+
+// An awaitable that can complete without suspending, and otherwise parks the
+// coroutine on waker() until try_complete() succeeds. try_complete() is
+// retried every time the coroutine is woken, so a wake-up that loses a race
+// (e.g. to another task taking the mutex first) simply parks it again, at the
+// head of the waker's queue so that it is next in line.
+template <typename AwaitableT>
+concept WakerAwaitable = requires(AwaitableT awaitable) {
+    {
+        awaitable.try_complete()
+    } -> std::same_as<bool>;
+    {
+        awaitable.waker()
+    } -> std::same_as<Waker &>;
+};
+
+// The WakerAwaitable a coroutine is currently suspended on, if any
+struct PendingWakerAwaitable
+{
+    void *awaitable = nullptr;
+    bool (*try_complete)(void *awaitable) = nullptr;
+    Waker &(*waker)(void *awaitable) = nullptr;
+
+    template <WakerAwaitable AwaitableT>
+    static PendingWakerAwaitable create(AwaitableT &awaitable)
+    {
+        return {
+            &awaitable,
+            [](void *p)
+            { return static_cast<AwaitableT *>(p)->try_complete(); },
+            [](void *p) -> Waker &
+            { return static_cast<AwaitableT *>(p)->waker(); },
+        };
+    }
+};
+
+template <typename ReturnTypeT>
+struct ReturnValueSlotFor
+{
+    using type = std::optional<ReturnTypeT>;
+};
+template <>
+struct ReturnValueSlotFor<void>
+{
+    using type = Void;
+};
+template <typename ReturnTypeT>
+using ReturnValueSlot = typename ReturnValueSlotFor<ReturnTypeT>::type;
+
+// A child task that can write its return value into a slot lent by the
+// awaiting coroutine
+template <typename TaskT, typename ReturnTypeT>
+concept TypedReturnTask =
+    std::is_void_v<ReturnTypeT> or
+    requires(TaskT &task, std::optional<ReturnTypeT> &slot) {
+        task.set_return_value_slot(slot);
+    };
+
+// The part of a promise that does not depend on the coroutine's type.
+// A coroutine that co_awaits a coroutine child transfers control to it
+// directly instead of going through the executor, and the child transfers
+// back when it finishes. The CoroutineTask owning the outermost (root)
+// coroutine of such a chain steps whichever coroutine is innermost (the
+// leaf), so only real suspensions reach the executor.
+struct CoroutinePromiseBase
+{
+    // How the coroutine last suspended. Whatever the step result is made
+    // from stays in the coroutine frame and is pointed to by suspension_data,
+    // so suspending neither builds nor moves a StepResult.
+    enum class Suspension : unsigned char
+    {
+        none,
+        // A step_result::Ready
+        ready,
+        // A Waker, waited on without a deadline
+        wait_for_waker,
+        // The std::unique_ptr<Task> of a child that is not a coroutine
+        wait_for_child,
+        // Any other StepResult
+        step_result,
+        // Returned, with boxed_return_value if nobody lent a slot for it
+        returned,
+    };
+    Suspension suspension = Suspension::none;
+    void *suspension_data = nullptr;
+    std::unique_ptr<void, TypeErasedDeleter> boxed_return_value;
+    // Thrown out of the coroutine, and rethrown into the coroutine awaiting
+    // it. A root coroutine that throws simply finishes.
+    std::exception_ptr exception;
+    Executor *most_recent_executor = nullptr;
+    // Only valid while the coroutine is being resumed
+    ChildReturnValues last_child_return_values;
+    PendingWakerAwaitable pending_awaitable;
+    std::coroutine_handle<> self;
+    // The coroutine awaiting this one, if it was started by transfer
+    CoroutinePromiseBase *parent = nullptr;
+    CoroutinePromiseBase *root = this;
+    // Only maintained on the root
+    CoroutinePromiseBase *leaf = this;
+
+    CoroutinePromiseBase() = default;
+    CoroutinePromiseBase(CoroutinePromiseBase const &) = delete;
+
+    void suspend(Suspension how, void *data = nullptr)
+    {
+        suspension = how;
+        suspension_data = data;
+    }
+
+    void mark_returned() { suspend(Suspension::returned); }
+
+    // The step result of the last suspension
+    StepResult take_step_result()
+    {
+        void *const data = suspension_data;
+        switch (std::exchange(suspension, Suspension::none))
+        {
+        case Suspension::ready:
+            return std::move(*static_cast<step_result::Ready *>(data));
+        case Suspension::wait_for_waker:
+            return step_result::Wait(step_result::Wait::task_not_done,
+                                     *static_cast<Waker *>(data));
+        case Suspension::wait_for_child:
+            return step_result::Wait(
+                step_result::Wait::task_not_done,
+                make_vector_unique<Task>(
+                    std::move(*static_cast<std::unique_ptr<Task> *>(data))));
+        case Suspension::step_result:
+            return std::move(*static_cast<StepResult *>(data));
+        case Suspension::returned:
+            return step_result::Done(std::move(boxed_return_value));
+        case Suspension::none:
+            break;
+        }
+        throw std::runtime_error("Coroutine did not suspend");
+    }
+
+    std::coroutine_handle<> start_child(CoroutinePromiseBase &child)
+    {
+        child.parent = this;
+        child.root = root;
+        child.most_recent_executor = most_recent_executor;
+        root->leaf = &child;
+        return child.self;
+    }
+
+    // Where control goes once this coroutine is finished
+    std::coroutine_handle<> finish()
+    {
+        if (parent == nullptr)
+            return std::noop_coroutine();
+        parent->most_recent_executor = most_recent_executor;
+        parent->suspension = Suspension::none;
+        parent->last_child_return_values = {};
+        root->leaf = parent;
+        return parent->self;
+    }
+
+    auto final_suspend() noexcept
+    {
+        struct awaiter : std::suspend_always
+        {
+            CoroutinePromiseBase &promise;
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<>)
+                const noexcept
+            {
+                return promise.finish();
+            }
+        };
+        return awaiter{{}, *this};
+    }
+};
+
+// A task running a coroutine, which a coroutine awaiting it can transfer to
+template <typename TaskT>
+concept CoroutineChildTask = requires(TaskT &task) {
+    {
+        &task.handle.promise()
+    } -> std::convertible_to<CoroutinePromiseBase *>;
+};
+
 template <typename PromiseType, typename ChildT, typename CoroutineTaskT>
-struct AbstractPromiseType
+struct AbstractPromiseType : public CoroutinePromiseBase
 {
-    SingleThreadedExecutor *most_recent_executor = nullptr;
-    std::optional<StepResult> step_result;
-    std::optional<
-        std::vector<std::optional<std::unique_ptr<void, TypeErasedDeleter>>>>
-        last_child_return_values;
+
+    // Coroutine frames share the pool used for Task objects
+    static void *operator new(std::size_t size)
+    {
+        return pool_allocator::allocate(size);
+    }
+    static void operator delete(void *p, std::size_t size) noexcept
+    {
+        pool_allocator::deallocate(p, size);
+    }
 
     std::unique_ptr<CoroutineTaskT> get_return_object()
     {
+        self = std::coroutine_handle<ChildT>::from_promise(
+            *static_cast<ChildT *>(this));
         return std::make_unique<CoroutineTaskT>(
             static_cast<ChildT *>(this)->get_name(),
             *static_cast<ChildT *>(this));
@@ -33,10 +225,28 @@ struct AbstractPromiseType
 
     std::suspend_always initial_suspend() { return {}; }
 
-    std::suspend_always yield_value(StepResult step_result)
+    // The yielded result is kept in the awaiter, which lives in the frame
+    // until the coroutine is resumed
+    template <typename StepResultT>
+    struct YieldAwaiter : std::suspend_always
+    {
+        CoroutinePromiseBase &promise;
+        StepResultT result;
+        void await_suspend(std::coroutine_handle<>)
+        {
+            if constexpr (std::is_same_v<StepResultT, step_result::Ready>)
+                promise.suspend(Suspension::ready, &result);
+            else
+                promise.suspend(Suspension::step_result, &result);
+        }
+    };
+    YieldAwaiter<step_result::Ready> yield_value(step_result::Ready result)
+    {
+        return {{}, *this, std::move(result)};
+    }
+    YieldAwaiter<StepResult> yield_value(StepResult result)
     {
-        this->step_result.emplace(std::move(step_result));
-        return {};
+        return {{}, *this, std::move(result)};
     }
 
     auto await_transform(ExecutorAwaiter)
@@ -45,7 +255,7 @@ struct AbstractPromiseType
         {
             PromiseType &promise;
             awaitable(PromiseType &promise) : promise(promise) {}
-            SingleThreadedExecutor &await_resume()
+            Executor &await_resume()
             {
                 return *promise.most_recent_executor;
             }
@@ -53,45 +263,119 @@ struct AbstractPromiseType
         return awaitable(*static_cast<PromiseType *>(this));
     }
 
+    template <WakerAwaitable AwaitableT>
+    auto await_transform(AwaitableT awaitable)
+    {
+        struct awaiter
+        {
+            PromiseType &promise;
+            AwaitableT awaitable;
+            bool await_ready() { return awaitable.try_complete(); }
+            void await_suspend(std::coroutine_handle<>)
+            {
+                promise.pending_awaitable =
+                    PendingWakerAwaitable::create(awaitable);
+                promise.suspend(
+                    CoroutinePromiseBase::Suspension::wait_for_waker,
+                    &awaitable.waker());
+            }
+            decltype(auto) await_resume()
+            {
+                if constexpr (requires { awaitable.result(); })
+                    return awaitable.result();
+            }
+        };
+        return awaiter{*static_cast<PromiseType *>(this),
+                       std::move(awaitable)};
+    }
+
+    // Awaiting a task with a void return type or a TypedReturnTask gives its
+    // return value. Any other task, such as a coroutine returning through
+    // PromiseTypeWithReturnValue, returns it boxed, so awaiting it gives a
+    // std::unique_ptr<UnambiguousReturnType>.
+    // If the task is cancelled, there is no value: a boxed one is null, and
+    // otherwise std::runtime_error is thrown into the awaiting coroutine.
     template <typename TaskT>
-        requires requires(TaskT) {
-            std::derived_from<TaskT, Task>;
-            typename TaskT::UnambiguousReturnType;
-        }
+        requires std::derived_from<TaskT, Task> and
+                 requires { typename TaskT::UnambiguousReturnType; }
     auto await_transform(std::unique_ptr<TaskT> task)
     {
-        struct awaitable : std::suspend_always
+        using ReturnTypeT = typename TaskT::UnambiguousReturnType;
+        static constexpr bool returns_boxed =
+            not TypedReturnTask<TaskT, ReturnTypeT>;
+        struct awaiter : std::suspend_always
         {
             PromiseType &promise;
-            awaitable(PromiseType &promise) : promise(promise) {}
-            std::unique_ptr<typename TaskT::UnambiguousReturnType>
-            await_resume() const noexcept
+            std::unique_ptr<TaskT> task;
+            std::unique_ptr<Task> child;
+            // The child writes its return value here, into our frame
+            [[no_unique_address]] ReturnValueSlot<ReturnTypeT> slot;
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<>)
             {
-                if constexpr (std::is_void_v<
-                                  typename TaskT::UnambiguousReturnType>)
+                if constexpr (not std::is_void_v<ReturnTypeT> and
+                              not returns_boxed)
+                    task->set_return_value_slot(slot);
+                // A coroutine child runs straight away, and we are resumed
+                // as soon as it finishes. It is destroyed along with task.
+                if constexpr (CoroutineChildTask<TaskT>)
+                    return promise.start_child(task->handle.promise());
+                else
+                {
+                    child = std::move(task);
+                    promise.suspend(
+                        CoroutinePromiseBase::Suspension::wait_for_child,
+                        &child);
+                    return std::noop_coroutine();
+                }
+            }
+            auto await_resume()
+            {
+                if constexpr (CoroutineChildTask<TaskT>)
+                {
+                    if (std::exception_ptr const &exception =
+                            task->handle.promise().exception)
+                        std::rethrow_exception(exception);
+                }
+                if constexpr (std::is_void_v<ReturnTypeT>)
                     return;
+                else if constexpr (returns_boxed)
+                    return std::unique_ptr<ReturnTypeT>(
+                        static_cast<ReturnTypeT *>(take_boxed().release()));
                 else
                 {
-                    std::optional<std::unique_ptr<void, TypeErasedDeleter>>
-                        ret_val =
-                            std::move((*promise.last_child_return_values)[0]);
-                    void *raw_ptr = ret_val->release();
-                    return std::unique_ptr<
-                        typename TaskT::UnambiguousReturnType>(
-                        reinterpret_cast<
-                            typename TaskT::UnambiguousReturnType *>(raw_ptr));
+                    // A child that finishes with step_result::Done instead
+                    // of returning passes its value boxed
+                    if (not slot)
+                        if (auto boxed = take_boxed())
+                            slot.emplace(std::move(
+                                *static_cast<ReturnTypeT *>(boxed.get())));
+                    // A child that was cancelled leaves nothing
+                    if (not slot)
+                        throw std::runtime_error(
+                            "Awaited task was cancelled");
+                    return *std::move(slot);
+                }
+            }
+            // A coroutine child leaves its boxed value in its promise, any
+            // other child hands it to us through the executor
+            std::unique_ptr<void, TypeErasedDeleter> take_boxed()
+            {
+                if constexpr (CoroutineChildTask<TaskT>)
+                    return std::move(task->handle.promise().boxed_return_value);
+                else
+                {
+                    ChildReturnValues values = promise.last_child_return_values;
+                    if (values.empty() or not values[0])
+                        return nullptr;
+                    return std::move(*values[0]);
                 }
             }
         };
-        this->step_result.emplace(
-            step_result::Wait(step_result::Wait::task_not_done,
-                              make_vector_unique<Task>(std::move(task))));
-        return awaitable(*static_cast<PromiseType *>(this));
+        return awaiter{
+            {}, *static_cast<PromiseType *>(this), std::move(task), {}, {}};
     }
 
-    std::suspend_always final_suspend() noexcept { return {}; }
-
-    void unhandled_exception() {}
+    void unhandled_exception() { exception = std::current_exception(); }
 };
 
 template <typename ChildT, typename CoroutineTaskT>
@@ -100,19 +384,40 @@ struct PromiseTypeWithReturnValue
           PromiseTypeWithReturnValue<ChildT, CoroutineTaskT>, ChildT,
           CoroutineTaskT>
 {
-    void return_value(Void) {}
+    void return_value(Void) { this->mark_returned(); }
 
     template <typename ReturnTypeT>
     void return_value(std::unique_ptr<ReturnTypeT> ret_val)
     {
-        this->step_result.emplace(step_result::Done(std::move(ret_val)));
+        this->boxed_return_value = make_type_erased(std::move(ret_val));
+        this->mark_returned();
     }
 
     template <typename ReturnTypeT>
     void return_value(ReturnTypeT ret_val)
     {
-        this->step_result.emplace(step_result::Done(
-            std::make_unique<ReturnTypeT>(std::move(ret_val))));
+        return_value(std::make_unique<ReturnTypeT>(std::move(ret_val)));
+    }
+};
+
+// Promise of a coroutine returning a ReturnTypeT by value, which, like a
+// ValueTask, writes it straight into the frame of a coroutine awaiting it
+template <typename ChildT, typename CoroutineTaskT, typename ReturnTypeT>
+struct ValuePromiseType
+    : public AbstractPromiseType<
+          ValuePromiseType<ChildT, CoroutineTaskT, ReturnTypeT>, ChildT,
+          CoroutineTaskT>
+{
+    std::optional<ReturnTypeT> *return_value_slot = nullptr;
+
+    void return_value(ReturnTypeT ret_val)
+    {
+        if (return_value_slot == nullptr)
+            this->boxed_return_value = make_type_erased(
+                std::make_unique<ReturnTypeT>(std::move(ret_val)));
+        else
+            return_value_slot->emplace(std::move(ret_val));
+        this->mark_returned();
     }
 };
 
@@ -121,45 +426,87 @@ struct PromiseType
     : public AbstractPromiseType<PromiseType<ChildT, CoroutineTaskT>, ChildT,
                                  CoroutineTaskT>
 {
-    void return_void() {}
+    void return_void() { this->mark_returned(); }
 };
 
 template <typename PromiseTypeT>
     requires requires(PromiseTypeT promise) {
         {
             promise.most_recent_executor
-        } -> DecaysTo<SingleThreadedExecutor *>;
+        } -> DecaysTo<Executor *>;
         {
             promise.last_child_return_values
-        } -> DecaysTo<std::optional<std::vector<
-            std::optional<std::unique_ptr<void, TypeErasedDeleter>>>>>;
+        } -> DecaysTo<ChildReturnValues>;
     }
 struct CoroutineTask : public Task
 {
     using promise_type = PromiseTypeT;
-    CoroutineTask(std::string name, promise_type &promise)
-        : Task(std::move(name)),
+    CoroutineTask(std::string_view name, promise_type &promise)
+        : Task(name),
           handle(std::coroutine_handle<promise_type>::from_promise(promise))
     {
     }
 
     std::coroutine_handle<promise_type> handle;
 
-    StepResult step_with_result(
-        SingleThreadedExecutor &executor,
-        std::vector<std::optional<std::unique_ptr<void, TypeErasedDeleter>>>
-            child_return_values) override final
-    {
-        handle.promise().most_recent_executor = &executor;
-        handle.promise().last_child_return_values =
-            std::move(child_return_values);
-        if (not handle.done())
-            handle.resume();
-        if (not handle.promise().step_result)
-            throw std::runtime_error("Should be present");
-        std::optional<StepResult> &opt_step_result =
-            handle.promise().step_result;
-        return std::move(*opt_step_result);
+    StepResult
+    step_with_result(Executor &executor,
+                     ChildReturnValues child_return_values) override final
+    {
+        CoroutinePromiseBase &root = handle.promise();
+        CoroutinePromiseBase *leaf = root.leaf;
+        leaf->most_recent_executor = &executor;
+        leaf->last_child_return_values = child_return_values;
+        PendingWakerAwaitable &pending = leaf->pending_awaitable;
+        if (pending.awaitable != nullptr)
+        {
+            if (not pending.try_complete(pending.awaitable))
+                return step_result::Wait(
+                    step_result::Wait::task_not_done,
+                    step_result::WaitForWaker(pending.waker(pending.awaitable),
+                                              true));
+            pending = {};
+        }
+        using Suspension = CoroutinePromiseBase::Suspension;
+        while (true)
+        {
+            leaf->suspension = Suspension::none;
+            if (not handle.done())
+                leaf->self.resume();
+            // Control may have moved up or down the chain
+            leaf = root.leaf;
+            // The root ended by an exception, which is dropped since no
+            // coroutine awaits it
+            if (leaf->suspension == Suspension::none and handle.done())
+                return step_result::Done();
+            step_result::Done *done = nullptr;
+            if (leaf != &root and leaf->suspension == Suspension::step_result)
+                done = std::get_if<step_result::Done>(
+                    static_cast<StepResult *>(leaf->suspension_data));
+            if (done == nullptr)
+                return leaf->take_step_result();
+            // A child coroutine that yields Done is finished as if it had
+            // returned, and its parent carries on. The parent's awaiter
+            // takes the return value, if any, from boxed_return_value.
+            leaf->boxed_return_value = std::move(done->return_value);
+            std::vector<std::unique_ptr<Task>> daemons =
+                std::move(done->child_tasks);
+            leaf->finish();
+            leaf = root.leaf;
+            if (not daemons.empty())
+                return step_result::Ready(true, std::move(daemons));
+        }
+    }
+
+    // Available when the coroutine returns through a ValuePromiseType
+    template <typename ReturnTypeT>
+        requires requires(promise_type &promise,
+                          std::optional<ReturnTypeT> &slot) {
+            promise.return_value_slot = &slot;
+        }
+    void set_return_value_slot(std::optional<ReturnTypeT> &slot)
+    {
+        handle.promise().return_value_slot = &slot;
     }
 
     ~CoroutineTask() { handle.destroy(); }
@@ -4,67 +4,182 @@
 #include "Task.h"
 #include "Waker.h"
 #include "utilities.h"
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
+#include <utility>
 #include <variant>
 
-bool SingleThreadedExecutor::is_sleeping_task_list_empty()
+SingleThreadedExecutor::SingleThreadedExecutor()
+{
+    sleeping_task_list.prev = &sleeping_task_list;
+    sleeping_task_list.next = &sleeping_task_list;
+    for (RunQueue &queue : run_queues)
+    {
+        queue.head.prev = &queue.head;
+        queue.head.next = &queue.head;
+    }
+}
+
+SingleThreadedExecutor::~SingleThreadedExecutor()
 {
-    return sleeping_task_list->next == nullptr;
+    while (run_queue_size != 0)
+        delete &pop_task();
+    // Iterative, so that tearing down many sleepers cannot overflow the stack
+    while (sleeping_task_list.next != &sleeping_task_list)
+    {
+        SleepingTask *node = sleeping_task_list.next;
+        sleeping_task_list.next = node->next;
+        delete &node->task();
+    }
 }
 
-size_t SingleThreadedExecutor::number_of_sleeping_tasks()
+bool SingleThreadedExecutor::is_sleeping_task_list_empty()
 {
-    size_t count{};
-    for (SleepingTask const *node = sleeping_task_list->next.get();
-         node != nullptr; node = node->next.get())
-        count++;
-    return count;
+    return sleeping_task_count == 0;
 }
 
 void SingleThreadedExecutor::print_tasks()
 {
     std::cerr << "++++++++++++++\n";
     std::cerr << "++Sleeping tasks\n";
-    for (SleepingTask const *node = sleeping_task_list.get();
-         node->next != nullptr; node = node->next.get())
-        std::cerr << '\t' << node->task->name << '\n';
+    for (SleepingTask *node = sleeping_task_list.next;
+         node != &sleeping_task_list; node = node->next)
+        std::cerr << '\t' << node->task().name << '\n';
     std::cerr << "--\n";
     std::cerr << "++Awake tasks\n";
-    for (std::unique_ptr<Task> const &task : tasks)
-        std::cerr << '\t' << task->name << '\n';
+    for (RunQueue &queue : run_queues)
+        for (SleepingTask *node = queue.head.next; node != &queue.head;
+             node = node->next)
+            std::cerr << '\t' << node->task().name << '\n';
     std::cerr << "--\n";
     std::cerr << "--------------\n";
 }
 
 void SingleThreadedExecutor::add_task(std::unique_ptr<Task> task)
 {
-    tasks.emplace_back(std::move(task));
+    spawn_task(*task.release(), nullptr);
+}
+
+void SingleThreadedExecutor::spawn_task(Task &task, Task *parent)
+{
+    if (stats)
+        ++stats->tasks_added;
+    // A task stolen from another worker was spawned, and traced as spawned,
+    // there. It keeps its id, and its name is registered with this worker's
+    // buffer when its next event is recorded.
+    if (trace and not trace->is_identified(task))
+        trace->record(TraceBuffer::EventType::spawn, task,
+                      parent ? trace->task_id(*parent) : 0);
+    push_task(task);
+}
+
+void SingleThreadedExecutor::push_task(Task &task, bool to_front)
+{
+    if (stats)
+        task.stats_timestamp = Clock::now();
+    Priority const priority =
+        std::min(task.get_priority(),
+                 task.wake_priority.value_or(Priority::background));
+    RunQueue &queue = run_queues[static_cast<size_t>(priority)];
+    SleepingTask &before = to_front ? *queue.head.next : queue.head;
+    task.prev = before.prev;
+    task.next = &before;
+    before.prev->next = &task;
+    before.prev = &task;
+    ++queue.size;
+    ++run_queue_size;
+}
+
+// Weighted round robin: the most urgent class with work and credits left
+// goes next. Once none has both, every class gets its weight in credits.
+Task &SingleThreadedExecutor::pop_task()
+{
+    RunQueue *queue = nullptr;
+    while (queue == nullptr)
+    {
+        for (RunQueue &candidate : run_queues)
+            if (candidate.size != 0 and candidate.credits != 0)
+            {
+                queue = &candidate;
+                break;
+            }
+        if (queue == nullptr)
+            for (size_t i = 0; i < number_of_priorities; ++i)
+                run_queues[i].credits = run_queue_weights[i];
+    }
+    --queue->credits;
+    Task &task = queue->head.next->task();
+    queue->head.next = task.next;
+    task.next->prev = &queue->head;
+    task.prev = nullptr;
+    task.next = nullptr;
+    task.wake_priority.reset();
+    --queue->size;
+    --run_queue_size;
+    return task;
+}
+
+void SingleThreadedExecutor::enable_stats(bool enable)
+{
+    if (enable)
+        stats = std::make_unique<Stats>();
+    else
+        stats.reset();
 }
 
-Counter::Counter(SingleThreadedExecutor &executor, std::unique_ptr<Waker> waker,
-                 size_t count)
-    : executor(executor),
-      shared(std::make_shared<Owned>(std::move(waker), count))
+SingleThreadedExecutor::Stats const *SingleThreadedExecutor::get_stats()
 {
+    if (stats)
+    {
+        stats->queued_tasks = run_queue_size;
+        stats->sleeping_tasks = sleeping_task_count;
+    }
+    return stats.get();
 }
-Waker &Counter::get_waker() { return *shared->waker; }
-void Counter::operator()()
+
+void SingleThreadedExecutor::enable_tracing(bool enable, size_t capacity)
 {
-    if (--shared->count == 0)
-        shared->waker->wake_one(executor);
+    if (enable)
+        trace = std::make_unique<TraceBuffer>(capacity);
+    else
+        trace.reset();
 }
 
+void SingleThreadedExecutor::add_remote_task(std::unique_ptr<Task> task)
+{
+    {
+        std::lock_guard lock(remote_tasks_mutex);
+        remote_tasks.push_back(std::move(task));
+        has_remote_tasks.store(true, std::memory_order_release);
+    }
+    reactor.notify();
+}
+
+void SingleThreadedExecutor::take_remote_tasks()
+{
+    std::vector<std::unique_ptr<Task>> taken;
+    {
+        std::lock_guard lock(remote_tasks_mutex);
+        taken.swap(remote_tasks);
+        has_remote_tasks.store(false, std::memory_order_relaxed);
+    }
+    for (std::unique_ptr<Task> &task : taken)
+        add_task(std::move(task));
+}
+
+Reactor &SingleThreadedExecutor::get_reactor() { return reactor; }
+
 // An ImmediatelyDestroyedTask does nothing, but can potentially do useful
 // things upon destruction It is meant to be used with
 // step_result::Wait::task_automatically_done The task is to be destroyed upon
 // wake from sleep queue.
 struct ImmediatelyDestroyedTask : public Task
 {
-    ImmediatelyDestroyedTask(std::string name) : Task(std::move(name)) {}
+    ImmediatelyDestroyedTask(std::string_view name) : Task(name) {}
 
-    StepResult step(SingleThreadedExecutor &executor) override final
+    StepResult step(Executor &executor) override final
     {
         throw std::runtime_error("PsuedoTask should not be executed");
         return step_result::Done();
@@ -74,78 +189,211 @@ struct ImmediatelyDestroyedTask : public Task
 template <typename RunOnceT>
 struct RunOnceTask : public Task
 {
-    RunOnceTask(std::string name) : Task(std::move(name)) {}
+    RunOnceTask(std::string_view name) : Task(name) {}
 
-    StepResult step(SingleThreadedExecutor &executor) override final
+    StepResult step(Executor &executor) override final
     {
         return static_cast<RunOnceT *>(this)->run_once(executor);
     }
 };
 
+// Waits in place of a subtask of a composite task. It refers to the group,
+// so it has the group's token and goes when the group is cancelled. If only
+// the subtask is cancelled, it is woken instead and hands the subtask back
+// to the group as done.
 struct CompositeWakeTask final : public RunOnceTask<CompositeWakeTask>
 {
-    Waker &composite_task_waker;
-    SubtaskStatus &leaf_status;
-    std::vector<std::reference_wrapper<SubtaskStatus>> statuses;
+    SubtaskGroup &leaf_group;
+    size_t leaf_index;
+    Rc<CancellationToken> subtask_token;
     bool destroy_on_wake;
-    CompositeWakeTask(
-        Waker &composite_task_waker, SubtaskStatus &leaf_status,
-        std::vector<std::reference_wrapper<SubtaskStatus>> statuses,
-        bool destroy_on_wake)
-        : RunOnceTask("CompositeWakeTask"),
-          composite_task_waker(composite_task_waker), leaf_status(leaf_status),
-          statuses(std::move(statuses)), destroy_on_wake(destroy_on_wake)
+    CompositeWakeTask(SubtaskGroup &leaf_group, size_t leaf_index,
+                      Rc<CancellationToken> subtask_token,
+                      bool destroy_on_wake)
+        : RunOnceTask("CompositeWakeTask"), leaf_group(leaf_group),
+          leaf_index(leaf_index), subtask_token(std::move(subtask_token)),
+          destroy_on_wake(destroy_on_wake)
     {
     }
 
-    step_result::Done run_once(SingleThreadedExecutor &executor)
+    bool wakes_on_cancel() const override
     {
-        if (destroy_on_wake)
-            leaf_status = SubtaskStatus::done;
-        else
-            leaf_status = SubtaskStatus::ready;
-        for (SubtaskStatus &status : statuses)
-            status = SubtaskStatus::ready;
-        
-        if (composite_task_waker.has_waiters())
-            composite_task_waker.wake_one(executor);
+        return subtask_token and subtask_token->is_cancelled();
+    }
 
+    step_result::Done run_once(Executor &executor)
+    {
+        leaf_group.wake_subtask(executor, leaf_index,
+                                destroy_on_wake or wakes_on_cancel());
         return {};
     }
 };
 
-void SingleThreadedExecutor::add_sleeping_task(std::unique_ptr<Task> task,
-                                               Waker &waker,
-                                               bool destroy_on_wake)
+void SingleThreadedExecutor::add_sleeping_task(
+    std::unique_ptr<Task> task, Waker *waker, bool destroy_on_wake,
+    std::optional<Clock::time_point> deadline, bool at_front_of_waker)
 {
-    sleeping_task_list = std::make_unique<SleepingTask>(
-        std::move(sleeping_task_list), std::move(task), destroy_on_wake);
-    waker.add_waiter(*sleeping_task_list);
+    SleepingTask &sleeping_task = *task.release();
+    sleeping_task.is_sleeping = true;
+    sleeping_task.steps_at_front = 0;
+    sleeping_task.destroy_on_wake = destroy_on_wake;
+    sleeping_task.timed_out = false;
+    sleeping_task.waker = waker;
+    sleeping_task.prev = &sleeping_task_list;
+    sleeping_task.next = sleeping_task_list.next;
+    sleeping_task_list.next->prev = &sleeping_task;
+    sleeping_task_list.next = &sleeping_task;
+    ++sleeping_task_count;
+    if (stats)
+    {
+        sleeping_task.stats_timestamp = Clock::now();
+        stats->max_sleeping_tasks =
+            std::max(stats->max_sleeping_tasks, sleeping_task_count);
+    }
+    if (deadline)
+    {
+        sleeping_task.deadline = *deadline;
+        timers.push(sleeping_task);
+    }
+    if (waker and at_front_of_waker)
+        waker->add_waiter_at_front(sleeping_task);
+    else if (waker)
+        waker->add_waiter(sleeping_task);
+}
+
+void SingleThreadedExecutor::unlink_sleeping_task(SleepingTask &sleeping_task)
+{
+    sleeping_task.is_sleeping = false;
+    sleeping_task.prev->next = sleeping_task.next;
+    sleeping_task.next->prev = sleeping_task.prev;
+    sleeping_task.prev = nullptr;
+    sleeping_task.next = nullptr;
+    --sleeping_task_count;
+    if (sleeping_task.timer_index != SleepingTask::no_timer)
+        timers.remove(sleeping_task);
 }
 
 void SingleThreadedExecutor::wake_sleeping_task(SleepingTask &sleeping_task)
 {
-    std::unique_ptr<SleepingTask> owned_sleeping_task;
-    if (sleeping_task.prev)
+    if (not sleeping_task.is_sleeping)
+        throw std::runtime_error("Unexpected");
+    unlink_sleeping_task(sleeping_task);
+    if (stats)
+    {
+        ++stats->tasks_woken;
+        if (sleeping_task.stats_timestamp >= stats->enabled_at)
+            stats->wake_latency_by_waker[sleeping_task.waker].record(
+                std::chrono::nanoseconds(Clock::now() -
+                                         sleeping_task.stats_timestamp)
+                    .count());
+    }
+    sleeping_task.waker = nullptr;
+    std::unique_ptr<Task> task(&sleeping_task.task());
+    if (trace)
+        trace->record(TraceBuffer::EventType::wake, *task,
+                      sleeping_task.timed_out);
+    if (sleeping_task.destroy_on_wake)
     {
-        if (sleeping_task.prev->next.get() != &sleeping_task)
-            throw std::runtime_error("Unexpected");
-        owned_sleeping_task = std::move(sleeping_task.prev->next);
-        owned_sleeping_task->next->prev = owned_sleeping_task->prev;
-        owned_sleeping_task->prev->next = std::move(owned_sleeping_task->next);
+        if (trace)
+            trace->record(TraceBuffer::EventType::done, *task);
+        task->done(*this);
     }
     else
+        push_task(*task.release());
+}
+
+void SingleThreadedExecutor::wake_sleeping_tasks(SleepingTask &first,
+                                                 SleepingTask &last)
+{
+    if (woken_tasks_tail)
     {
-        if (sleeping_task_list.get() != &sleeping_task)
-            throw std::runtime_error("Unexpected");
-        owned_sleeping_task = std::move(sleeping_task_list);
-        sleeping_task_list = std::move(owned_sleeping_task->next);
-        sleeping_task_list->prev = nullptr;
+        woken_tasks_tail->wait_queue_next = &first;
+        first.wait_queue_prev = woken_tasks_tail;
     }
-    if (owned_sleeping_task->destroy_on_wake)
-        owned_sleeping_task->task->done();
     else
-        add_task(std::move(owned_sleeping_task->task));
+        woken_tasks_head = &first;
+    woken_tasks_tail = &last;
+}
+
+void SingleThreadedExecutor::settle_woken_tasks()
+{
+    SleepingTask *node = std::exchange(woken_tasks_head, nullptr);
+    woken_tasks_tail = nullptr;
+    while (node != nullptr)
+    {
+        SleepingTask &sleeping_task = *node;
+        node = sleeping_task.wait_queue_next;
+        sleeping_task.wait_queue_prev = nullptr;
+        sleeping_task.wait_queue_next = nullptr;
+        wake_sleeping_task(sleeping_task);
+    }
+}
+
+void SingleThreadedExecutor::finish_cancelled_task(std::unique_ptr<Task> task)
+{
+    if (trace)
+        trace->record(TraceBuffer::EventType::cancelled, *task);
+    task->done(*this);
+}
+
+void SingleThreadedExecutor::cancel(CancellationToken &token)
+{
+    // Woken tasks are no longer parked on their wakers
+    settle_woken_tasks();
+    token.cancel();
+    // Unlink every cancelled sleeper before destroying any, since a sleeper
+    // may be parked on a waker that another one owns. Tasks waiting for their
+    // children stay until the last child finishes and wakes them.
+    SleepingTask cancelled;
+    cancelled.prev = &cancelled;
+    cancelled.next = &cancelled;
+    for (SleepingTask *node = sleeping_task_list.next;
+         node != &sleeping_task_list;)
+    {
+        Task &task = node->task();
+        node = node->next;
+        if (task.number_of_unfinished_children != 0)
+            continue;
+        if (not task.is_cancelled())
+        {
+            if (task.wakes_on_cancel())
+            {
+                if (task.waker)
+                    task.waker->remove_waiter(task);
+                wake_sleeping_task(task);
+            }
+            continue;
+        }
+        if (task.waker)
+            task.waker->remove_waiter(task);
+        task.waker = nullptr;
+        unlink_sleeping_task(task);
+        task.prev = cancelled.prev;
+        task.next = &cancelled;
+        cancelled.prev->next = &task;
+        cancelled.prev = &task;
+    }
+    while (cancelled.next != &cancelled)
+    {
+        Task &task = cancelled.next->task();
+        cancelled.next = task.next;
+        task.prev = nullptr;
+        task.next = nullptr;
+        finish_cancelled_task(std::unique_ptr<Task>(&task));
+    }
+}
+
+void SingleThreadedExecutor::wake_expired_timers()
+{
+    Clock::time_point const now = Clock::now();
+    while (not timers.empty() and timers.top().deadline <= now)
+    {
+        SleepingTask &sleeping_task = timers.top();
+        if (sleeping_task.waker)
+            sleeping_task.waker->remove_waiter(sleeping_task);
+        sleeping_task.timed_out = true;
+        wake_sleeping_task(sleeping_task);
+    }
 }
 
 void SingleThreadedExecutor::handle_wait(std::unique_ptr<Task> task,
@@ -155,64 +403,155 @@ void SingleThreadedExecutor::handle_wait(std::unique_ptr<Task> task,
         wait.on_wait_finish == step_result::Wait::task_automatically_done;
     if (auto *wait_for_waker =
             std::get_if<step_result::WaitForWaker>(&wait.wait_for))
-        add_sleeping_task(std::move(task), wait_for_waker->waker,
-                          destroy_on_wake);
+    {
+        if (trace)
+            trace->record(TraceBuffer::EventType::wait_for_waker, *task,
+                          reinterpret_cast<uintptr_t>(&wait_for_waker->waker));
+        add_sleeping_task(std::move(task), &wait_for_waker->waker,
+                          destroy_on_wake, wait.deadline,
+                          wait_for_waker->at_front);
+    }
+    else if (auto *wait_until =
+                 std::get_if<step_result::WaitUntil>(&wait.wait_for))
+    {
+        if (trace)
+            trace->record(TraceBuffer::EventType::wait_until, *task);
+        add_sleeping_task(std::move(task), nullptr, destroy_on_wake,
+                          wait_until->deadline);
+    }
     else if (auto *wait_for_child_tasks =
                  std::get_if<step_result::WaitForChildTasks>(&wait.wait_for))
     {
         if (wait_for_child_tasks->tasks.empty())
             return;
 
-        Counter counter(*this, std::make_unique<SingleTaskWaker>(),
-                        wait_for_child_tasks->tasks.size());
-        auto &waker = counter.get_waker();
+        size_t const number_of_children = wait_for_child_tasks->tasks.size();
+        if (trace)
+            trace->record(TraceBuffer::EventType::wait_for_children, *task,
+                          number_of_children);
+        task->number_of_unfinished_children = number_of_children;
         task->last_child_return_values.clear();
-        task->last_child_return_values.resize(
-            wait_for_child_tasks->tasks.size());
-        for (size_t i = wait_for_child_tasks->tasks.size(); i-- > 0;)
+        task->last_child_return_values.resize(number_of_children);
+        for (size_t i = number_of_children; i-- > 0;)
         {
             std::unique_ptr<Task> &child_task = wait_for_child_tasks->tasks[i];
+            child_task->parent = task.get();
+            child_task->inherit_from(*task);
             child_task->parent_return_value_location =
                 &task->last_child_return_values[i];
-            if (i == 0)
-                child_task->on_done_callbacks.push_back(std::move(counter));
-            else
-                child_task->on_done_callbacks.push_back(counter);
-            tasks.emplace_back(std::move(child_task));
+            spawn_task(*child_task.release(), task.get());
         }
-        add_sleeping_task(std::move(task), waker, destroy_on_wake);
+        // Woken directly by the last child to finish
+        add_sleeping_task(std::move(task), nullptr, destroy_on_wake);
     }
 }
 
-ExecutorStepResult SingleThreadedExecutor::step()
+ExecutorStepResult SingleThreadedExecutor::step(bool may_block)
 {
-    if (tasks.empty())
+    if (has_remote_tasks.load(std::memory_order_acquire))
+        take_remote_tasks();
+    // Before the timers, which must not find a woken task's waker still
+    // holding it
+    if (woken_tasks_head)
+        settle_woken_tasks();
+    if (not timers.empty())
+        wake_expired_timers();
+    if (reactor.has_registrations() and
+        ++steps_since_reactor_poll >= reactor_poll_interval)
+    {
+        steps_since_reactor_poll = 0;
+        reactor.poll(*this, Clock::duration::zero());
+        // Handlers may have woken whole wait queues
+        if (woken_tasks_head)
+            settle_woken_tasks();
+    }
+    if (run_queue_size == 0)
     {
+        if (not timers.empty() or reactor.has_registrations())
+        {
+            // Nothing can run until a deadline passes, a file descriptor
+            // becomes ready or another thread adds a task
+            if (may_block)
+            {
+                wait_for_work();
+                return ExecutorStepResult::more_to_go;
+            }
+            steps_since_reactor_poll = 0;
+            reactor.poll(*this, Clock::duration::zero());
+            return run_queue_size != 0 or woken_tasks_head
+                       ? ExecutorStepResult::more_to_go
+                       : ExecutorStepResult::waiting;
+        }
         if (is_sleeping_task_list_empty())
             return ExecutorStepResult::done;
         else
             return ExecutorStepResult::done_with_tasks_sleeping;
     }
-    std::unique_ptr<Task> task = std::move(tasks.front());
-    tasks.pop_front();
-    StepResult result = task->step_with_result(
-        *this, std::move(task->last_child_return_values));
-    std::optional<std::unique_ptr<void, TypeErasedDeleter>> return_value;
+    std::unique_ptr<Task> task(&pop_task());
+    Waker *const woken_by = std::exchange(task->woken_by, nullptr);
+    if (task->is_cancelled())
+    {
+        // A wake meant for one waiter, such as a mutex's, must not be lost
+        if (woken_by)
+            woken_by->wake_one(*this);
+        finish_cancelled_task(std::move(task));
+        return ExecutorStepResult::more_to_go;
+    }
+    Clock::time_point step_start;
+    if (stats or trace)
+        step_start = Clock::now();
+    if (stats)
+    {
+        ++stats->steps;
+        stats->queue_depth.record(run_queue_size + 1);
+        // Tasks queued before stats were enabled have no timestamp
+        if (task->stats_timestamp >= stats->enabled_at)
+            stats->queue_latency.record(
+                std::chrono::nanoseconds(step_start - task->stats_timestamp)
+                    .count());
+    }
+    StepResult result =
+        task->step_with_result(*this, task->last_child_return_values);
+    if (stats or trace)
+    {
+        Clock::duration const duration = Clock::now() - step_start;
+        if (stats)
+        {
+            uint64_t const step_time =
+                std::chrono::nanoseconds(duration).count();
+            stats->step_time.record(step_time);
+            stats->step_time_by_task_name[task->name].record(step_time);
+        }
+        if (trace)
+            trace->record(TraceBuffer::EventType::step, *task, 0, step_start,
+                          duration);
+    }
+    if (not task->last_child_return_values.empty())
+        task->last_child_return_values.clear();
+    ChildReturnValue return_value;
     if (auto *done = std::get_if<step_result::Done>(&result))
     {
         return_value.emplace(std::move(done->return_value));
         for (auto &child_task : done->child_tasks)
-            tasks.emplace_back(std::move(child_task));
+        {
+            child_task->inherit_from(*task);
+            spawn_task(*child_task.release(), task.get());
+        }
     }
     else if (auto *ready = std::get_if<step_result::Ready>(&result))
     {
+        bool to_front = false;
         if (ready->high_priority)
-            tasks.push_front(std::move(task));
+            to_front = requeue_at_front(*task);
         else
-            tasks.push_back(std::move(task));
-
+            task->steps_at_front = 0;
+        Task &parent = *task.release();
+        push_task(parent, to_front);
         for (auto &child_task : ready->child_tasks)
-            tasks.emplace_back(std::move(child_task));
+        {
+            child_task->inherit_from(parent);
+            spawn_task(*child_task.release(), &parent);
+        }
     }
     else if (auto *wait = std::get_if<step_result::Wait>(&result))
     {
@@ -225,14 +564,29 @@ ExecutorStepResult SingleThreadedExecutor::step()
                                      step_result::Wait::task_automatically_done;
         step_result::Wait wait(step_result::Wait::task_not_done,
                                std::move(composite_wait->wait.wait_for));
-        handle_wait(std::make_unique<CompositeWakeTask>(
-                        composite_wait->root_waker, composite_wait->leaf_status,
-                        std::move(composite_wait->statuses), destroy_on_wake),
-                    wait);
+        wait.deadline = composite_wait->wait.deadline;
+        Rc<CancellationToken> &subtask_token =
+            composite_wait->leaf_cancellation_token;
+        // The subtask's children are cancelled along with it, although the
+        // wake task stands in as their parent
+        if (auto *wait_for_child_tasks =
+                std::get_if<step_result::WaitForChildTasks>(&wait.wait_for))
+            for (std::unique_ptr<Task> &child : wait_for_child_tasks->tasks)
+                if (not child->get_cancellation_token())
+                    child->set_cancellation_token(subtask_token);
+        auto wake_task = std::make_unique<CompositeWakeTask>(
+            composite_wait->leaf_group, composite_wait->leaf_index,
+            std::move(subtask_token), destroy_on_wake);
+        wake_task->inherit_from(*task);
+        handle_wait(std::move(wake_task), wait);
         if (composite_wait->all_subtasks_sleeping)
-            add_sleeping_task(std::move(task), composite_wait->root_waker, false);    
+            add_sleeping_task(std::move(task), &composite_wait->root_waker,
+                              false);
         else
-            tasks.push_front(std::move(task));
+        {
+            bool const to_front = requeue_at_front(*task);
+            push_task(*task.release(), to_front);
+        }
     }
     else
     {
@@ -245,11 +599,76 @@ ExecutorStepResult SingleThreadedExecutor::step()
             return_value.has_value())
             task->parent_return_value_location->emplace(
                 *std::move(return_value));
-        task->done();
+        if (trace)
+            trace->record(TraceBuffer::EventType::done, *task);
+        task->done(*this);
     }
     return ExecutorStepResult::more_to_go;
 }
 
+void SingleThreadedExecutor::wait_for_work()
+{
+    std::optional<Clock::duration> timeout;
+    if (not timers.empty())
+        timeout = std::max(timers.top().deadline - Clock::now(),
+                           Clock::duration::zero());
+    if (run_deadline)
+        timeout = std::min(
+            timeout.value_or(Clock::duration::max()),
+            std::max(*run_deadline - Clock::now(), Clock::duration::zero()));
+    steps_since_reactor_poll = 0;
+    reactor.poll(*this, timeout);
+}
+
+bool SingleThreadedExecutor::requeue_at_front(Task &task)
+{
+    if (++task.steps_at_front < step_budget)
+        return true;
+    task.steps_at_front = 0;
+    return false;
+}
+
+void SingleThreadedExecutor::set_reactor_poll_interval(unsigned steps)
+{
+    reactor_poll_interval = std::max(steps, 1u);
+}
+
+void SingleThreadedExecutor::set_step_budget(unsigned steps)
+{
+    step_budget = std::max(steps, 1u);
+}
+
+ExecutorStepResult Executor::run_batch(size_t max_steps)
+{
+    ExecutorStepResult result = ExecutorStepResult::more_to_go;
+    for (size_t i = 0; i < max_steps; ++i)
+        if ((result = step()) != ExecutorStepResult::more_to_go)
+            break;
+    return result;
+}
+
+ExecutorStepResult Executor::run_for(Clock::duration duration)
+{
+    Clock::time_point const deadline = Clock::now() + duration;
+    ExecutorStepResult result;
+    while ((result = step()) == ExecutorStepResult::more_to_go and
+           Clock::now() < deadline)
+        ;
+    return result;
+}
+
+ExecutorStepResult SingleThreadedExecutor::run_for(Clock::duration duration)
+{
+    // So that waiting for I/O or a timer cannot overrun the deadline
+    run_deadline = Clock::now() + duration;
+    ExecutorStepResult result;
+    while ((result = step()) == ExecutorStepResult::more_to_go and
+           Clock::now() < *run_deadline)
+        ;
+    run_deadline.reset();
+    return result;
+}
+
 void SingleThreadedExecutor::run_until_completion()
 {
     ExecutorStepResult result;
@@ -1 +1,2 @@
-struct SingleThreadedExecutor;
+class Executor;
+class SingleThreadedExecutor;
\ No newline at end of file
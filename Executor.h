@@ -1,54 +1,191 @@
 #pragma once
+#include "Histogram.h"
+#include "Reactor.h"
 #include "Task.h"
+#include "TimerHeap.h"
+#include "TraceBuffer.h"
 #include "Waker.h"
-#include <deque>
+#include <array>
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 enum class ExecutorStepResult
 {
     done,
     more_to_go,
     done_with_tasks_sleeping,
+    // Only from a step that may not block: nothing can run until a timer
+    // expires, a file descriptor becomes ready or another thread adds a task
+    waiting,
 };
 
-class Counter
+// Interface through which tasks, wakers and synchronisation primitives talk to
+// whichever scheduler is running them.
+class Executor
 {
-    SingleThreadedExecutor &executor;
-    struct Owned
+public:
+    virtual void print_tasks() = 0;
+    virtual void add_task(std::unique_ptr<Task>) = 0;
+    virtual void wake_sleeping_task(SleepingTask &sleeping_task) = 0;
+    // Wakes every task of a list detached from a waker, linked from first to
+    // last through the tasks' wait queue links
+    virtual void wake_sleeping_tasks(SleepingTask &first,
+                                     SleepingTask &last) = 0;
+    // Cancels the token and destroys the sleeping tasks it covers, see
+    // CancellationToken
+    virtual void cancel(CancellationToken &token) = 0;
+    virtual Reactor &get_reactor() = 0;
+    virtual ExecutorStepResult step() = 0;
+    virtual void run_until_completion() = 0;
+    // Steps at most max_steps times. Returns more_to_go if it stopped at the
+    // limit.
+    ExecutorStepResult run_batch(size_t max_steps);
+    // Steps until the duration has passed, likewise returning more_to_go if
+    // there is still work left. A step that is running when the time is up
+    // is finished first.
+    virtual ExecutorStepResult run_for(Clock::duration duration);
+    virtual ~Executor() {}
+};
+
+// final so that calls made through a SingleThreadedExecutor & are devirtualised
+class SingleThreadedExecutor final : public Executor
+{
+    // Head sentinel of a circular list threaded through the sleeping tasks,
+    // which are owned by the list while they sleep.
+    SleepingTask sleeping_task_list;
+    size_t sleeping_task_count = 0;
+    // Likewise for the runnable tasks, one list per Priority. A task is never
+    // in both kinds of list, so they share its links, and waking a task just
+    // moves it from one to the other.
+    struct RunQueue
     {
-        std::unique_ptr<Waker> waker;
-        size_t count;
+        SleepingTask head;
+        size_t size = 0;
+        // Steps left in the current round of weighted round robin
+        unsigned credits = 0;
     };
-    std::shared_ptr<Owned> shared;
+    std::array<RunQueue, number_of_priorities> run_queues;
+    // Steps per round of each class while the classes below it have work
+    static constexpr std::array<unsigned, number_of_priorities>
+        run_queue_weights{16, 4, 1};
+    size_t run_queue_size = 0;
+    // Lists handed over by wake_sleeping_tasks are spliced on here, still
+    // linked through their wait queue links and still counted as sleeping.
+    // Only at the start of the next step, or of a cancel(), is each task
+    // unlinked from the sleeping list and its timer and queued by priority.
+    SleepingTask *woken_tasks_head = nullptr;
+    SleepingTask *woken_tasks_tail = nullptr;
+    // Sleeping tasks with a deadline
+    TimerHeap timers;
+    Reactor reactor;
+    // While there are runnable tasks the reactor is only polled every so
+    // many steps
+    unsigned reactor_poll_interval = 64;
+    unsigned steps_since_reactor_poll = 0;
+    unsigned step_budget = 16;
+    // While in run_for, an idle executor blocks no later than this
+    std::optional<Clock::time_point> run_deadline;
+    std::mutex remote_tasks_mutex;
+    std::vector<std::unique_ptr<Task>> remote_tasks;
+    std::atomic<bool> has_remote_tasks = false;
 
 public:
-    Counter(SingleThreadedExecutor &executor, std::unique_ptr<Waker> waker,
-            size_t count);
-    Waker &get_waker();
-    void operator()();
-};
+    // Opt-in instrumentation, scraped through get_stats(). Durations are in
+    // nanoseconds.
+    struct Stats
+    {
+        Clock::time_point enabled_at = Clock::now();
+        uint64_t steps = 0;
+        // Tasks added from outside or spawned as children by other tasks.
+        // Spawn rate = tasks_added / (now - enabled_at)
+        uint64_t tasks_added = 0;
+        // Sleeping tasks woken, whether or not they are queued again
+        uint64_t tasks_woken = 0;
+        // Refreshed by get_stats()
+        size_t queued_tasks = 0;
+        size_t sleeping_tasks = 0;
+        size_t max_sleeping_tasks = 0;
+        // Sampled at every step
+        Histogram queue_depth;
+        // How long a task sits in the queue between being queued, whether
+        // spawned, woken or requeued, and being stepped
+        Histogram queue_latency;
+        Histogram step_time;
+        std::unordered_map<std::string_view, Histogram> step_time_by_task_name;
+        // From going to sleep to being woken, keyed by the waker slept on.
+        // Wakers are only used as keys and may no longer exist. Tasks that
+        // only wait for a deadline or for child tasks are under nullptr.
+        std::unordered_map<Waker const *, Histogram> wake_latency_by_waker;
+    };
 
-class SingleThreadedExecutor
-{
-    std::unique_ptr<SleepingTask> sleeping_task_list;
-    std::deque<std::unique_ptr<Task>> tasks;
+private:
+    // Null unless enabled, so that it costs a branch per step when disabled
+    std::unique_ptr<Stats> stats;
+    // Likewise null unless tracing is enabled
+    std::unique_ptr<TraceBuffer> trace;
+    // Every enqueue goes through here
+    void push_task(Task &task, bool to_front = false);
+    Task &pop_task();
+    void take_remote_tasks();
+    // Queues a task that is new to the executor. parent is null for tasks
+    // added from outside.
+    void spawn_task(Task &task, Task *parent);
     bool is_sleeping_task_list_empty();
-    size_t number_of_sleeping_tasks();
     void handle_wait(std::unique_ptr<Task>, step_result::Wait &);
-    void add_sleeping_task(std::unique_ptr<Task> task, Waker &waker,
-                           bool destroy_on_wake);
+    // waker may be null for a task that only waits for its deadline
+    void add_sleeping_task(
+        std::unique_ptr<Task> task, Waker *waker, bool destroy_on_wake,
+        std::optional<Clock::time_point> deadline = std::nullopt,
+        bool at_front_of_waker = false);
+    void wake_expired_timers();
+    void settle_woken_tasks();
+    void unlink_sleeping_task(SleepingTask &sleeping_task);
+    void finish_cancelled_task(std::unique_ptr<Task> task);
+    bool requeue_at_front(Task &task);
 
 public:
-    SingleThreadedExecutor()
-        : sleeping_task_list(std::make_unique<SleepingTask>()) // head sentinel
-    {
-    }
-    void print_tasks();
-    void add_task(std::unique_ptr<Task>);
-    void wake_sleeping_task(SleepingTask &sleeping_task);
-    ExecutorStepResult step();
-    void run_until_completion();
-};
-
-// We may want to implement abstract class Executor in future
-using Executor = SingleThreadedExecutor;
\ No newline at end of file
+    SingleThreadedExecutor();
+    SingleThreadedExecutor(SingleThreadedExecutor const &) = delete;
+    ~SingleThreadedExecutor();
+    void print_tasks() override;
+    void add_task(std::unique_ptr<Task>) override;
+    // Thread-safe counterpart of add_task, which also wakes the executor if
+    // it is blocked waiting for I/O or a timer
+    void add_remote_task(std::unique_ptr<Task>);
+    void wake_sleeping_task(SleepingTask &sleeping_task) override;
+    // Splices the list onto woken_tasks_head in O(1)
+    void wake_sleeping_tasks(SleepingTask &first, SleepingTask &last) override;
+    void cancel(CancellationToken &token) override;
+    Reactor &get_reactor() override;
+    size_t number_of_sleeping_tasks() const { return sleeping_task_count; }
+    ExecutorStepResult step() override { return step(true); }
+    // With may_block false, an executor with nothing to run only polls the
+    // reactor and returns waiting, leaving it to the caller to look for work
+    // elsewhere before it calls wait_for_work().
+    ExecutorStepResult step(bool may_block);
+    // Blocks until a timer expires, a file descriptor becomes ready or
+    // another thread adds a task or calls the reactor's notify()
+    void wait_for_work();
+    void run_until_completion() override;
+    ExecutorStepResult run_for(Clock::duration duration) override;
+    // How many steps may pass between two non-blocking polls of the reactor
+    // while there are runnable tasks
+    void set_reactor_poll_interval(unsigned steps);
+    // How many steps in a row a task may keep itself at the front of the run
+    // queue, with Ready(true), before it is sent to the back regardless
+    void set_step_budget(unsigned steps);
+    // Enabling resets any stats gathered so far
+    void enable_stats(bool enable = true);
+    // Null while stats are disabled
+    Stats const *get_stats();
+    // Records scheduling events into a ring buffer of the given capacity,
+    // replacing any previous trace
+    void enable_tracing(bool enable = true, size_t capacity = 1 << 16);
+    // Null while tracing is disabled
+    TraceBuffer const *get_trace() const { return trace.get(); }
+};
\ No newline at end of file
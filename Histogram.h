@@ -0,0 +1,45 @@
+#pragma once
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+// Histogram with power-of-2 buckets, cheap enough to update on every step.
+// Bucket i counts the values v with std::bit_width(v) == i, i.e. 0 in bucket
+// 0 and [2^(i-1), 2^i) in bucket i.
+struct Histogram
+{
+    std::array<uint64_t, 65> buckets{};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    void record(uint64_t value)
+    {
+        ++buckets[std::bit_width(value)];
+        ++count;
+        sum += value;
+        if (value > max)
+            max = value;
+    }
+
+    double mean() const
+    {
+        return count == 0 ? 0 : static_cast<double>(sum) / count;
+    }
+
+    // Upper bound of the bucket containing the given fraction of values, e.g.
+    // percentile(0.99) >= the 99th percentile
+    uint64_t percentile(double fraction) const
+    {
+        uint64_t const target = static_cast<uint64_t>(fraction * count);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets.size(); ++i)
+        {
+            seen += buckets[i];
+            if (seen > target or seen == count)
+                return i == 0 ? 0 : (i == 64 ? UINT64_MAX : (1ull << i) - 1);
+        }
+        return max;
+    }
+};
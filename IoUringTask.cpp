@@ -0,0 +1,345 @@
+#include "IoUringTask.h"
+#include "Executor.h"
+#include "StepResult.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+[[noreturn]] void throw_errno(char const *what)
+{
+    std::array<char, 1024> buf;
+    std::snprintf(buf.data(), buf.size(), "%s: %s", what, strerror(errno));
+    throw std::runtime_error(buf.data());
+}
+
+template <typename T>
+T *at_offset(void *base, uint32_t offset)
+{
+    return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+}
+
+// The ring indices are shared with the kernel
+unsigned load_acquire(unsigned *p)
+{
+    return std::atomic_ref<unsigned>(*p).load(std::memory_order_acquire);
+}
+void store_release(unsigned *p, unsigned value)
+{
+    std::atomic_ref<unsigned>(*p).store(value, std::memory_order_release);
+}
+
+io_uring_sqe make_sqe(uint8_t opcode, int fd, void const *addr, uint32_t len,
+                      uint64_t offset)
+{
+    io_uring_sqe sqe{};
+    sqe.opcode = opcode;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uint64_t>(addr);
+    sqe.len = len;
+    sqe.off = offset;
+    return sqe;
+}
+} // namespace
+
+IoUringTask::ReadinessHandler::ReadinessHandler(IoUringTask &task) : task(task)
+{
+    fd = task.ring_fd;
+}
+
+std::unique_ptr<Task>
+IoUringTask::ReadinessHandler::handle(Executor &executor,
+                                      uint32_t active_events [[maybe_unused]])
+{
+    task.waker.wake_one(executor);
+    return nullptr;
+}
+
+IoUringTask::IoUringTask(unsigned entries)
+    : Task("IoUringTask"), readiness_handler(*this)
+{
+    // Dispatches I/O completions, which should not wait behind background
+    // work
+    set_priority(Priority::latency_critical);
+    io_uring_params params{};
+    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (ring_fd == -1)
+        throw_errno("io_uring_setup");
+    // From here on the destructor is not run if we throw, so clean up here
+    try
+    {
+        sq_ring_size =
+            params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size =
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool const single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED)
+        {
+            sq_ring = nullptr;
+            throw_errno("mmap sq ring");
+        }
+        if (single_mmap)
+            cq_ring = sq_ring;
+        else
+        {
+            cq_ring =
+                mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ring == MAP_FAILED)
+            {
+                cq_ring = nullptr;
+                throw_errno("mmap cq ring");
+            }
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void *sqes_mapping =
+            mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes_mapping == MAP_FAILED)
+            throw_errno("mmap sqes");
+        sqes = static_cast<io_uring_sqe *>(sqes_mapping);
+    }
+    catch (...)
+    {
+        if (cq_ring and cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_size);
+        if (sq_ring)
+            munmap(sq_ring, sq_ring_size);
+        close(ring_fd);
+        throw;
+    }
+    sq_head = at_offset<unsigned>(sq_ring, params.sq_off.head);
+    sq_tail = at_offset<unsigned>(sq_ring, params.sq_off.tail);
+    sq_mask = *at_offset<unsigned>(sq_ring, params.sq_off.ring_mask);
+    sq_entries = *at_offset<unsigned>(sq_ring, params.sq_off.ring_entries);
+    sq_array = at_offset<unsigned>(sq_ring, params.sq_off.array);
+    cq_head = at_offset<unsigned>(cq_ring, params.cq_off.head);
+    cq_tail = at_offset<unsigned>(cq_ring, params.cq_off.tail);
+    cq_mask = *at_offset<unsigned>(cq_ring, params.cq_off.ring_mask);
+    cqes = at_offset<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+}
+
+IoUringTask::~IoUringTask()
+{
+    if (reactor)
+        reactor->remove(ring_fd);
+    munmap(sqes, sqes_size);
+    if (cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    munmap(sq_ring, sq_ring_size);
+    if (close(ring_fd) == -1)
+        perror("close ring_fd: ");
+}
+
+void IoUringTask::wake()
+{
+    if (executor and waker.has_waiters())
+        waker.wake_one(*executor);
+}
+
+unsigned IoUringTask::push_sqe(io_uring_sqe const &sqe)
+{
+    unsigned tail = *sq_tail;
+    if (tail - load_acquire(sq_head) == sq_entries)
+    {
+        submit();
+        if (tail - load_acquire(sq_head) == sq_entries)
+            throw std::runtime_error("io_uring submission queue full");
+    }
+    unsigned const index = tail & sq_mask;
+    sqes[index] = sqe;
+    sq_array[index] = index;
+    store_release(sq_tail, tail + 1);
+    ++number_of_unsubmitted_sqes;
+    return tail;
+}
+
+void IoUringTask::queue(Operation &operation)
+{
+    if (operation.sqe.opcode == IORING_OP_TIMEOUT)
+        operation.sqe.addr = reinterpret_cast<uint64_t>(&operation.timespec);
+    operation.sqe.user_data = reinterpret_cast<uint64_t>(&operation);
+    operation.sq_position = push_sqe(operation.sqe);
+    ++number_of_operations_in_flight;
+    operation.state = Operation::State::in_flight;
+    // Submission happens in step(), batched with whatever else is queued
+    // before the IoUringTask runs
+    wake();
+}
+
+void IoUringTask::cancel(Operation &operation)
+{
+    unsigned const head = load_acquire(sq_head);
+    if (operation.sq_position - head < *sq_tail - head)
+    {
+        // Not submitted yet, so the kernel has not seen it. A NOP takes its
+        // place, since the SQEs after it may already be submitted.
+        sqes[operation.sq_position & sq_mask] =
+            make_sqe(IORING_OP_NOP, -1, nullptr, 0, 0);
+        operation.state = Operation::State::completed;
+        --number_of_operations_in_flight;
+    }
+    else
+        push_sqe(make_sqe(IORING_OP_ASYNC_CANCEL, -1, &operation, 0, 0));
+    // The operation completes with -ECANCELED, or with its result if it beat
+    // the cancellation
+    while (operation.state == Operation::State::in_flight)
+    {
+        submit();
+        if (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS,
+                    nullptr, 0) == -1 and
+            errno != EINTR)
+            throw_errno("io_uring_enter");
+        reap();
+    }
+    // Whatever else was reaped is for the IoUringTask to carry on with
+    wake();
+}
+
+void IoUringTask::submit()
+{
+    while (number_of_unsubmitted_sqes != 0)
+    {
+        long const submitted =
+            syscall(__NR_io_uring_enter, ring_fd, number_of_unsubmitted_sqes,
+                    0, 0, nullptr, 0);
+        if (submitted == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            // Out of resources until completions are reaped
+            if (errno == EAGAIN or errno == EBUSY)
+                return;
+            throw_errno("io_uring_enter");
+        }
+        number_of_unsubmitted_sqes -= static_cast<unsigned>(submitted);
+    }
+}
+
+void IoUringTask::reap()
+{
+    unsigned head = *cq_head;
+    unsigned const tail = load_acquire(cq_tail);
+    for (; head != tail; ++head)
+    {
+        io_uring_cqe const &cqe = cqes[head & cq_mask];
+        // Cancellations and the NOPs of cancelled operations have no
+        // operation
+        if (cqe.user_data == 0)
+            continue;
+        Operation &operation = *reinterpret_cast<Operation *>(cqe.user_data);
+        operation.completion_result = cqe.res;
+        operation.state = Operation::State::completed;
+        --number_of_operations_in_flight;
+        if (executor)
+            operation.completion_waker.wake_one(*executor,
+                                                Priority::latency_critical);
+    }
+    store_release(cq_head, head);
+}
+
+StepResult IoUringTask::step(Executor &executor)
+{
+    if (reactor == nullptr)
+    {
+        this->executor = &executor;
+        reactor = &executor.get_reactor();
+        reactor->add(ring_fd, EPOLLIN, readiness_handler);
+    }
+    submit();
+    reap();
+    if (is_stopping and number_of_operations_in_flight == 0)
+    {
+        reactor->remove(ring_fd);
+        reactor = nullptr;
+        return step_result::Done();
+    }
+    if (number_of_unsubmitted_sqes != 0)
+        return step_result::Ready();
+    return step_result::Wait(step_result::Wait::task_not_done, waker);
+}
+
+void IoUringTask::stop()
+{
+    is_stopping = true;
+    wake();
+}
+
+IoUringTask::Operation::~Operation()
+{
+    if (state == State::in_flight)
+        ring->cancel(*this);
+}
+
+bool IoUringTask::Operation::try_complete()
+{
+    switch (state)
+    {
+    case State::not_queued:
+        ring->queue(*this);
+        return false;
+    case State::in_flight:
+        return false;
+    case State::completed:
+        return true;
+    }
+    return false;
+}
+
+IoUringTask::Operation IoUringTask::read(int fd, std::span<std::byte> buffer,
+                                         uint64_t offset)
+{
+    return Operation(*this,
+                     make_sqe(IORING_OP_READ, fd, buffer.data(),
+                              static_cast<uint32_t>(buffer.size()), offset));
+}
+
+IoUringTask::Operation IoUringTask::write(int fd,
+                                          std::span<std::byte const> buffer,
+                                          uint64_t offset)
+{
+    return Operation(*this,
+                     make_sqe(IORING_OP_WRITE, fd, buffer.data(),
+                              static_cast<uint32_t>(buffer.size()), offset));
+}
+
+IoUringTask::Operation IoUringTask::accept(int fd, sockaddr *address,
+                                           socklen_t *address_length,
+                                           int flags)
+{
+    io_uring_sqe sqe = make_sqe(IORING_OP_ACCEPT, fd, address, 0,
+                                reinterpret_cast<uint64_t>(address_length));
+    sqe.accept_flags = static_cast<uint32_t>(flags);
+    return Operation(*this, sqe);
+}
+
+IoUringTask::Operation IoUringTask::connect(int fd, sockaddr const *address,
+                                            socklen_t address_length)
+{
+    return Operation(
+        *this, make_sqe(IORING_OP_CONNECT, fd, address, 0, address_length));
+}
+
+IoUringTask::Operation IoUringTask::timeout(Clock::duration duration)
+{
+    auto const seconds = std::chrono::floor<std::chrono::seconds>(duration);
+    Operation operation(*this, make_sqe(IORING_OP_TIMEOUT, -1, nullptr, 1, 0));
+    operation.timespec.tv_sec = seconds.count();
+    operation.timespec.tv_nsec =
+        std::chrono::nanoseconds(duration - seconds).count();
+    return operation;
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include "Reactor.h"
+#include "Task.h"
+#include "TimerHeap.h"
+#include "Waker.h"
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <span>
+#include <sys/socket.h>
+
+// Completion-based I/O through io_uring, as an alternative to EpollTask.
+// Operations are WakerAwaitables, so a coroutine can simply
+//     int32_t n = co_await ring.read(fd, buffer);
+// The first try_complete() of an operation queues its SQE. Every SQE queued
+// between two steps of the IoUringTask goes to the kernel in one
+// io_uring_enter. The ring's fd is registered with the executor's reactor, so
+// the IoUringTask sleeps until completions arrive, then reaps all CQEs and
+// wakes the waker of each completed operation.
+// An operation must not outlive its IoUringTask, nor its buffers outlive the
+// operation. An operation that is destroyed in flight, such as when its task
+// is cancelled, is cancelled in the kernel and waited for, since the kernel
+// writes into those buffers until it completes.
+class IoUringTask final : public Task
+{
+public:
+    class Operation
+    {
+        friend class IoUringTask;
+        IoUringTask *ring;
+        io_uring_sqe sqe;
+        // Pointed to by the SQE of timeout operations
+        __kernel_timespec timespec{};
+        ReusableSingleTaskWaker completion_waker;
+        int32_t completion_result = 0;
+        enum class State
+        {
+            not_queued,
+            in_flight,
+            completed,
+        };
+        State state = State::not_queued;
+        // The SQ tail it was queued at, to tell whether it was submitted
+        unsigned sq_position = 0;
+        Operation(IoUringTask &ring, io_uring_sqe const &sqe)
+            : ring(&ring), sqe(sqe)
+        {
+        }
+
+    public:
+        // Only copyable before it is queued
+        Operation(Operation const &) = default;
+        ~Operation();
+        bool try_complete();
+        Waker &waker() { return completion_waker; }
+        // cqe->res: a byte count or file descriptor, or -errno on failure
+        int32_t result() const { return completion_result; }
+    };
+
+private:
+    class ReadinessHandler final : public Handler
+    {
+        IoUringTask &task;
+
+    public:
+        ReadinessHandler(IoUringTask &task);
+        std::unique_ptr<Task> handle(Executor &executor,
+                                     uint32_t active_events) override;
+    };
+
+    int ring_fd;
+    void *sq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    void *cq_ring = nullptr;
+    size_t cq_ring_size = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe *cqes;
+
+    unsigned number_of_unsubmitted_sqes = 0;
+    size_t number_of_operations_in_flight = 0;
+    bool is_stopping = false;
+    ReusableSingleTaskWaker waker;
+    ReadinessHandler readiness_handler;
+    Executor *executor = nullptr;
+    Reactor *reactor = nullptr;
+
+    unsigned push_sqe(io_uring_sqe const &sqe);
+    void queue(Operation &operation);
+    // Blocks until the operation has completed
+    void cancel(Operation &operation);
+    void submit();
+    void reap();
+    void wake();
+
+public:
+    explicit IoUringTask(unsigned entries = 256);
+    IoUringTask(IoUringTask &&) = delete;
+    StepResult step(Executor &) override;
+    ~IoUringTask();
+
+    // offset -1 means the current file position
+    Operation read(int fd, std::span<std::byte> buffer, uint64_t offset = -1);
+    Operation write(int fd, std::span<std::byte const> buffer,
+                    uint64_t offset = -1);
+    Operation accept(int fd, sockaddr *address = nullptr,
+                     socklen_t *address_length = nullptr, int flags = 0);
+    Operation connect(int fd, sockaddr const *address,
+                      socklen_t address_length);
+    // Completes with -ETIME once the duration has passed
+    Operation timeout(Clock::duration duration);
+
+    // The task finishes once the operations in flight have completed
+    void stop();
+};
@@ -2,8 +2,22 @@
 
 Mutex::Mutex() : waker(std::make_unique<FifoWaker>()) {}
 
-StepResult MutexAcquireTask::step(SingleThreadedExecutor &executor
-                                  [[maybe_unused]])
+bool Mutex::try_lock()
+{
+    if (is_acquired)
+        return false;
+    is_acquired = true;
+    return true;
+}
+
+void Mutex::unlock(Executor &executor)
+{
+    is_acquired = false;
+    if (waker->has_waiters())
+        waker->wake_one(executor);
+}
+
+StepResult MutexAcquireTask::step(Executor &executor [[maybe_unused]])
 {
     if (!mutex.is_acquired)
     {
@@ -15,8 +29,17 @@ StepResult MutexAcquireTask::step(SingleThreadedExecutor &executor
                                  step_result::WaitForWaker(*mutex.waker.get()));
 }
 
-StepResult RcMutexAcquireTask::step(SingleThreadedExecutor &executor
-                                    [[maybe_unused]])
+StepResult TimedMutexAcquireTask::step(Executor &executor [[maybe_unused]])
+{
+    if (mutex.try_lock())
+        return done_with(true);
+    if (Clock::now() >= deadline)
+        return done_with(false);
+    return step_result::Wait(step_result::Wait::task_not_done, *mutex.waker,
+                             deadline);
+}
+
+StepResult RcMutexAcquireTask::step(Executor &executor [[maybe_unused]])
 {
     if (!mutex->is_acquired)
     {
@@ -29,19 +52,15 @@ StepResult RcMutexAcquireTask::step(SingleThreadedExecutor &executor
             step_result::WaitForWaker(*mutex->waker.get()));
 }
 
-StepResult MutexReleaseTask::step(SingleThreadedExecutor &executor)
+StepResult MutexReleaseTask::step(Executor &executor)
 {
-    mutex.is_acquired = false;
-    if (mutex.waker->has_waiters())
-        mutex.waker->wake_one(executor);
+    mutex.unlock(executor);
     return step_result::Done();
 }
 
-StepResult RcMutexReleaseTask::step(SingleThreadedExecutor &executor)
+StepResult RcMutexReleaseTask::step(Executor &executor)
 {
-    mutex->is_acquired = false;
-    if (mutex->waker->has_waiters())
-        mutex->waker->wake_one(executor);
+    mutex->unlock(executor);
     return step_result::Done();
 }
 
@@ -60,8 +79,6 @@ std::unique_ptr<CoroMutexAcquireTask> mutex_acquire_task(Rc<Mutex> mutex)
 
 std::unique_ptr<CoroMutexReleaseTask> mutex_release_task(Rc<Mutex> mutex)
 {
-    mutex->is_acquired = false;
-    if (mutex->waker->has_waiters())
-        mutex->waker->wake_one(co_await executor_awaiter);
+    mutex->unlock(co_await executor_awaiter);
     co_yield step_result::Done();
 }
\ No newline at end of file
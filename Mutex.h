@@ -2,13 +2,64 @@
 #include "CoroutineTask.h"
 #include "Rc.h"
 #include "Task.h"
+#include "ValueTask.h"
 #include "Waker.h"
+#include <utility>
 
 struct Mutex
 {
     bool is_acquired = false;
     std::unique_ptr<Waker> waker; // mutex queue
     Mutex();
+
+    struct LockAwaitable
+    {
+        Mutex &mutex;
+        bool try_complete() { return mutex.try_lock(); }
+        Waker &waker() { return *mutex.waker; }
+    };
+    // Unlocks the mutex when destroyed, so that a coroutine holding the mutex
+    // through a guard releases it even if it is cancelled and its frame is
+    // destroyed
+    class Guard
+    {
+        Mutex *mutex;
+        Executor *executor;
+
+    public:
+        Guard(Mutex &mutex, Executor &executor)
+            : mutex(&mutex), executor(&executor)
+        {
+        }
+        Guard(Guard &&other) noexcept
+            : mutex(std::exchange(other.mutex, nullptr)),
+              executor(other.executor)
+        {
+        }
+        Guard &operator=(Guard &&) = delete;
+        ~Guard() { unlock(); }
+        void unlock()
+        {
+            if (mutex)
+                std::exchange(mutex, nullptr)->unlock(*executor);
+        }
+    };
+    struct GuardedLockAwaitable : LockAwaitable
+    {
+        Executor &executor;
+        Guard result() { return Guard(mutex, executor); }
+    };
+    bool try_lock();
+    // co_await mutex.lock() takes a free mutex without suspending the
+    // coroutine, and only parks on the mutex queue under contention.
+    LockAwaitable lock() { return {*this}; }
+    // Likewise, giving a Guard:
+    //     Mutex::Guard guard = co_await mutex.lock(executor);
+    GuardedLockAwaitable lock(Executor &executor)
+    {
+        return {{*this}, executor};
+    }
+    void unlock(Executor &executor);
 };
 class MutexAcquireTask final : public Task
 {
@@ -16,7 +67,22 @@ class MutexAcquireTask final : public Task
 
 public:
     MutexAcquireTask(Mutex &mutex) : Task("MutexAcquireTask"), mutex(mutex) {}
-    StepResult step(SingleThreadedExecutor &) override;
+    StepResult step(Executor &) override;
+};
+
+// Acquires the mutex unless the deadline passes first, returning whether it
+// was acquired
+class TimedMutexAcquireTask final : public ValueTask<bool>
+{
+    Mutex &mutex;
+    Clock::time_point deadline;
+
+public:
+    TimedMutexAcquireTask(Mutex &mutex, Clock::time_point deadline)
+        : ValueTask("TimedMutexAcquireTask"), mutex(mutex), deadline(deadline)
+    {
+    }
+    StepResult step(Executor &) override;
 };
 
 class RcMutexAcquireTask final : public Task
@@ -28,7 +94,7 @@ public:
         : Task("MutexAcquireTask"), mutex(std::move(mutex))
     {
     }
-    StepResult step(SingleThreadedExecutor &) override;
+    StepResult step(Executor &) override;
 };
 
 class MutexReleaseTask final : public Task
@@ -37,7 +103,7 @@ class MutexReleaseTask final : public Task
 
 public:
     MutexReleaseTask(Mutex &mutex) : Task("MutexReleaseTask"), mutex(mutex) {}
-    StepResult step(SingleThreadedExecutor &) override;
+    StepResult step(Executor &) override;
 };
 
 class RcMutexReleaseTask final : public Task
@@ -49,19 +115,19 @@ public:
         : Task("MutexReleaseTask"), mutex(std::move(mutex))
     {
     }
-    StepResult step(SingleThreadedExecutor &) override;
+    StepResult step(Executor &) override;
 };
 
 struct CoroMutexAcquireTask;
 struct CoroMutexAcquireTaskPromise
     : PromiseType<CoroMutexAcquireTaskPromise, CoroMutexAcquireTask>
 {
-    static std::string get_name() { return "CoroMutexAcquireTaskPromise"; }
+    static std::string_view get_name() { return "CoroMutexAcquireTaskPromise"; }
 };
 struct CoroMutexAcquireTask final : CoroutineTask<CoroMutexAcquireTaskPromise>
 {
-    CoroMutexAcquireTask(std::string name, promise_type &promise)
-        : CoroutineTask(std::move(name), promise)
+    CoroMutexAcquireTask(std::string_view name, promise_type &promise)
+        : CoroutineTask(name, promise)
     {
     }
 };
@@ -72,12 +138,12 @@ struct CoroMutexReleaseTask;
 struct CoroMutexReleaseTaskPromise final
     : PromiseType<CoroMutexReleaseTaskPromise, CoroMutexReleaseTask>
 {
-    static std::string get_name() { return "CoroMutexReleaseTaskPromise"; }
+    static std::string_view get_name() { return "CoroMutexReleaseTaskPromise"; }
 };
 struct CoroMutexReleaseTask : public CoroutineTask<CoroMutexReleaseTaskPromise>
 {
-    CoroMutexReleaseTask(std::string name, promise_type &promise)
-        : CoroutineTask(std::move(name), promise)
+    CoroMutexReleaseTask(std::string_view name, promise_type &promise)
+        : CoroutineTask(name, promise)
     {
     }
 };
@@ -0,0 +1,89 @@
+#include "PoolAllocator.h"
+#include <array>
+#include <new>
+
+namespace
+{
+constexpr std::size_t granularity = 16;
+constexpr std::size_t max_pooled_size = 512;
+constexpr std::size_t number_of_size_classes = max_pooled_size / granularity;
+// Bounds the memory a thread can keep cached after a burst of allocations
+constexpr std::size_t max_cached_blocks_per_size_class = 4096;
+
+struct FreeBlock
+{
+    FreeBlock *next;
+};
+
+struct SizeClass
+{
+    FreeBlock *head = nullptr;
+    std::size_t count = 0;
+};
+
+// Trivially destructible, so it can still be read after the cache below has
+// been destroyed during thread exit.
+thread_local bool is_thread_cache_destroyed = false;
+
+struct ThreadCache
+{
+    std::array<SizeClass, number_of_size_classes> size_classes;
+    ~ThreadCache()
+    {
+        for (SizeClass &size_class : size_classes)
+            while (FreeBlock *block = size_class.head)
+            {
+                size_class.head = block->next;
+                ::operator delete(block);
+            }
+        is_thread_cache_destroyed = true;
+    }
+};
+thread_local ThreadCache thread_cache;
+
+std::size_t size_class_index(std::size_t size)
+{
+    return (size + granularity - 1) / granularity - 1;
+}
+} // namespace
+
+namespace pool_allocator
+{
+void *allocate(std::size_t size)
+{
+    if (size == 0)
+        size = 1;
+    if (size > max_pooled_size or is_thread_cache_destroyed)
+        return ::operator new(size);
+    std::size_t const index = size_class_index(size);
+    SizeClass &size_class = thread_cache.size_classes[index];
+    if (FreeBlock *block = size_class.head)
+    {
+        size_class.head = block->next;
+        --size_class.count;
+        return block;
+    }
+    return ::operator new((index + 1) * granularity);
+}
+
+void deallocate(void *p, std::size_t size) noexcept
+{
+    if (p == nullptr)
+        return;
+    if (size == 0)
+        size = 1;
+    if (size > max_pooled_size or is_thread_cache_destroyed)
+    {
+        ::operator delete(p);
+        return;
+    }
+    SizeClass &size_class = thread_cache.size_classes[size_class_index(size)];
+    if (size_class.count == max_cached_blocks_per_size_class)
+    {
+        ::operator delete(p);
+        return;
+    }
+    size_class.head = ::new (p) FreeBlock{size_class.head};
+    ++size_class.count;
+}
+} // namespace pool_allocator
@@ -0,0 +1,15 @@
+#pragma once
+#include <cstddef>
+
+// Size-class free lists for the small, short-lived objects the executor churns
+// through: tasks and coroutine frames. A freed block is cached by the thread
+// that frees it and handed out again by that thread's next allocation of the
+// same size class, so the usual create/step/destroy cycle of a task stays off
+// malloc. Blocks are individually obtained from ::operator new, so freeing on
+// another thread than the allocating one (e.g. under WorkStealingExecutor) is
+// safe.
+namespace pool_allocator
+{
+void *allocate(std::size_t size);
+void deallocate(void *p, std::size_t size) noexcept;
+} // namespace pool_allocator
@@ -1,211 +1,231 @@
 #pragma once
+#include <atomic>
 #include <cstddef>
-#include <cstdio>
-#include <cstdlib>
-#include <iostream>
-#include <optional>
+#include <type_traits>
 #include <utility>
-// reference counted non-thread-safe shared pointer
-struct Deleter
+
+// Reference counted shared pointers: Rc for state shared between tasks of one
+// thread, Arc for state shared across threads.
+// A handle is a pointer to the object plus a pointer to its control block,
+// which holds the count and knows how to destroy whatever owns the object.
+// create() puts the object inside the control block, so that there is one
+// allocation per object. Aliasing handles, such as an Rc<Mutex> to a member of
+// a shared object, share the control block of the object they point into, so
+// copying one is a pointer copy and a count increment.
+// Types that derive from RcCounted<T> or ArcCounted<T> carry the control
+// block themselves, so that an owning handle can be made from a plain pointer
+// to them at any time.
+
+class NonAtomicRefCount
 {
-    void *real_ptr;
-    void (*deleter)(void *p);
-    Deleter(void *real_ptr, void (*deleter)(void *p))
-        : real_ptr(real_ptr), deleter(deleter)
+    unsigned count;
+
+public:
+    explicit NonAtomicRefCount(unsigned count) : count(count) {}
+    void increment() { ++count; }
+    // Whether the count dropped to 0
+    bool decrement() { return --count == 0; }
+};
+
+class AtomicRefCount
+{
+    std::atomic<unsigned> count;
+
+public:
+    explicit AtomicRefCount(unsigned count) : count(count) {}
+    void increment() { count.fetch_add(1, std::memory_order_relaxed); }
+    bool decrement()
     {
+        if (count.fetch_sub(1, std::memory_order_release) != 1)
+            return false;
+        // Order the destruction after every other handle's last use
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
     }
-    void operator()() { deleter(real_ptr); }
 };
-template <typename T>
-class Rc
-{
-    template <typename>
-    friend class Rc;
-    T *ptr;
-    unsigned *count;
 
-    std::optional<Deleter> deleter;
-    Rc(T *ptr, unsigned *count) : ptr(ptr), count(count)
+template <typename RefCountT>
+class RcControlBlock
+{
+    template <typename, typename>
+    friend class BasicRc;
+    RefCountT count;
+    void (*destroy)(RcControlBlock *);
+
+protected:
+    RcControlBlock(unsigned count, void (*destroy)(RcControlBlock *))
+        : count(count), destroy(destroy)
     {
-#ifndef NDEBUG
-        std::cerr << "Rc(T *ptr, unsigned *count)\n";
-#endif
     }
+};
 
-public:
-    explicit Rc(T *ptr) : ptr(ptr), count{new unsigned(1)}
+// Derive from RcCounted<T> or ArcCounted<T> for an intrusive count
+template <typename T, typename RefCountT>
+class IntrusiveRefCounted : public RcControlBlock<RefCountT>
+{
+    static void destroy(RcControlBlock<RefCountT> *block)
     {
-#ifndef NDEBUG
-        std::cerr << "Rc(T *ptr)\n";
-#endif
+        delete static_cast<T *>(static_cast<IntrusiveRefCounted *>(block));
     }
 
-    template <typename... Args>
-    static Rc<T> create(Args &&...args)
-    {
-#ifndef NDEBUG
-        std::cerr << "Rc<T> create(Args &&...args)\n";
-#endif
-        // Incorrect for now because we always do 2 deletes in destructor
-        // whereas there is only 1 allocation here.
-        // void *p = malloc(offsetof(Rc, deleter));
-        // T *ptr = (T *)p;
-        // unsigned *count = (unsigned *)((char *)p + offsetof(Rc<T>, count));
-        // std::construct_at(ptr, std::forward<Args>(args)...);
-        // std::construct_at(count, 1);
-        // return Rc<T>(ptr, count);
-
-        return Rc(new T(std::forward<Args>(args)...));
+protected:
+    // Owned by the handles made from it, not by whoever constructed it
+    IntrusiveRefCounted() : RcControlBlock<RefCountT>(0, destroy) {}
+    IntrusiveRefCounted(IntrusiveRefCounted const &)
+        : RcControlBlock<RefCountT>(0, destroy)
+    {
     }
+    IntrusiveRefCounted &operator=(IntrusiveRefCounted const &)
+    {
+        return *this;
+    }
+};
+
+template <typename T>
+using RcCounted = IntrusiveRefCounted<T, NonAtomicRefCount>;
+template <typename T>
+using ArcCounted = IntrusiveRefCounted<T, AtomicRefCount>;
+
+template <typename T, typename RefCountT>
+class BasicRc
+{
+    template <typename, typename>
+    friend class BasicRc;
+    using ControlBlock = RcControlBlock<RefCountT>;
+    static constexpr bool is_intrusive = std::is_base_of_v<ControlBlock, T>;
+
+    // Made by create(), holding the object
+    struct InlineControlBlock final : ControlBlock
+    {
+        T value;
+        template <typename... Args>
+        InlineControlBlock(Args &&...args)
+            : ControlBlock(1, destroy), value(std::forward<Args>(args)...)
+        {
+        }
+        static void destroy(ControlBlock *block)
+        {
+            delete static_cast<InlineControlBlock *>(block);
+        }
+    };
+
+    // Made when adopting an object allocated elsewhere
+    struct PointerControlBlock final : ControlBlock
+    {
+        T *ptr;
+        explicit PointerControlBlock(T *ptr)
+            : ControlBlock(1, destroy), ptr(ptr)
+        {
+        }
+        static void destroy(ControlBlock *block)
+        {
+            delete static_cast<PointerControlBlock *>(block)->ptr;
+            delete static_cast<PointerControlBlock *>(block);
+        }
+    };
 
-    Rc() = default;
+    T *ptr = nullptr;
+    ControlBlock *control_block = nullptr;
 
-    Rc(std::nullptr_t) : ptr(), count()
+    BasicRc(T *ptr, ControlBlock *control_block)
+        : ptr(ptr), control_block(control_block)
     {
-#ifndef NDEBUG
-        std::cerr << "Rc(std::nullptr_t = nullptr)\n";
-#endif
     }
 
-    Rc(Rc const &other)
-        : ptr(other.ptr), count(other.count), deleter(other.deleter)
+    void release()
     {
-#ifndef NDEBUG
-        std::cerr << "Rc(Rc const &other)\n";
-#endif
-        if (count)
-            ++*count;
+        if (control_block != nullptr and control_block->count.decrement())
+            control_block->destroy(control_block);
     }
 
-    template <typename U>
-    Rc(Rc<U> const &other)
-        : ptr(other.ptr), count(other.count), deleter(other.deleter)
-    {
-#ifndef NDEBUG
-        std::cerr << "Rc(Rc<U> const &other)\n";
-#endif
-        if (count)
-            ++*count;
+public:
+    // Takes ownership of ptr, which must have been allocated with new. Costs
+    // an allocation for the control block unless T carries its own count.
+    explicit BasicRc(T *ptr) : ptr(ptr)
+    {
+        if (ptr == nullptr)
+            return;
+        if constexpr (is_intrusive)
+        {
+            control_block = ptr;
+            control_block->count.increment();
+        }
+        else
+            control_block = new PointerControlBlock(ptr);
     }
 
-    Rc(Rc &&other) : ptr(other.ptr), count{other.count}, deleter(other.deleter)
+    template <typename... Args>
+    static BasicRc create(Args &&...args)
     {
-#ifndef NDEBUG
-        std::cerr << "Rc(Rc<U> &&other)\n";
-#endif
-        other.ptr = nullptr;
-        other.count = nullptr;
-        other.deleter = std::nullopt;
+        if constexpr (is_intrusive)
+            return BasicRc(new T(std::forward<Args>(args)...));
+        else
+        {
+            auto *block = new InlineControlBlock(std::forward<Args>(args)...);
+            return BasicRc(&block->value, block);
+        }
     }
 
-    template <typename U>
-    Rc(Rc<U> &&other)
-        : ptr(other.ptr), count{other.count}, deleter(other.deleter)
-    {
-#ifndef NDEBUG
-        std::cerr << "Rc(Rc<U> &&other)\n";
-#endif
-        other.ptr = nullptr;
-        other.count = nullptr;
-        other.deleter = std::nullopt;
+    BasicRc() = default;
+    BasicRc(std::nullptr_t) {}
+
+    BasicRc(BasicRc const &other)
+        : ptr(other.ptr), control_block(other.control_block)
+    {
+        if (control_block)
+            control_block->count.increment();
     }
 
-    // aliasing constructor
     template <typename U>
-    Rc(Rc<U> const &other, T *alias)
-        : ptr(alias), count(other.count),
-          deleter(Deleter(other.ptr,
-                          [](void *p) { delete reinterpret_cast<U *>(p); }))
-    {
-#ifndef NDEBUG
-        std::cerr << "Rc(Rc<U> const &other, T *alias)\n";
-#endif
-        // assume non null
-        ++*count;
+    BasicRc(BasicRc<U, RefCountT> const &other)
+        : ptr(other.ptr), control_block(other.control_block)
+    {
+        if (control_block)
+            control_block->count.increment();
     }
 
-    Rc<T> &operator=(Rc<T> const &other)
-    {
-#ifndef NDEBUG
-        std::cerr << "Rc<T> &operator=(Rc<U> const &other)\n";
-#endif
-        if (&other == this)
-            return *this;
-        ptr = other.ptr;
-        count = other.count;
-        deleter = other.deleter;
-        if (count)
-            ++*count;
-        return *this;
+    BasicRc(BasicRc &&other) noexcept
+        : ptr(std::exchange(other.ptr, nullptr)),
+          control_block(std::exchange(other.control_block, nullptr))
+    {
     }
 
     template <typename U>
-    Rc<T> &operator=(Rc<U> const &other)
-    {
-#ifndef NDEBUG
-        std::cerr << "Rc<T> &operator=(Rc<U> const &other)\n";
-#endif
-        if (&other == this)
-            return *this;
-        ptr = other.ptr;
-        count = other.count;
-        deleter = other.deleter;
-        if (count)
-            ++*count;
-        return *this;
+    BasicRc(BasicRc<U, RefCountT> &&other) noexcept
+        : ptr(std::exchange(other.ptr, nullptr)),
+          control_block(std::exchange(other.control_block, nullptr))
+    {
     }
 
-    Rc<T> &operator=(Rc<T> &&other)
-    {
-#ifndef NDEBUG
-        std::cerr << "Rc<T> &operator=(Rc<U> &&other)\n";
-#endif
-        if (&other == this)
-            return *this;
-        ptr = other.ptr;
-        count = other.count;
-        deleter = other.deleter;
-        other.ptr = nullptr;
-        other.count = nullptr;
-        other.deleter = std::nullopt;
-        return *this;
+    // Aliasing constructor: points at alias, typically a member of *other,
+    // while keeping all of *other alive
+    template <typename U>
+    BasicRc(BasicRc<U, RefCountT> const &other, T *alias)
+        : ptr(alias), control_block(other.control_block)
+    {
+        if (control_block)
+            control_block->count.increment();
     }
 
-    template <typename U>
-    Rc<T> &operator=(Rc<U> &&other)
-    {
-#ifndef NDEBUG
-        std::cerr << "Rc<T> &operator=(Rc<U> &&other)\n";
-#endif
-        if (&other == this)
-            return *this;
-        ptr = other.ptr;
-        count = other.count;
-        deleter = other.deleter;
-        other.ptr = nullptr;
-        other.count = nullptr;
-        other.deleter = std::nullopt;
+    BasicRc &operator=(BasicRc other) noexcept
+    {
+        std::swap(ptr, other.ptr);
+        std::swap(control_block, other.control_block);
         return *this;
     }
 
-    T &operator*() { return *ptr; }
+    ~BasicRc() { release(); }
 
-    T *operator->() { return ptr; }
-
-    T *get() { return ptr; }
+    T &operator*() const { return *ptr; }
+    T *operator->() const { return ptr; }
+    T *get() const { return ptr; }
+    explicit operator bool() const { return ptr != nullptr; }
+};
 
-    ~Rc()
-    {
-#ifndef NDEBUG
-        std::cerr << "~Rc()\n";
-#endif
-        if (count != nullptr and --*count == 0)
-        {
-            if (deleter)
-                (*deleter)();
-            else
-                delete ptr;
-            delete count;
-        }
-    }
-};
\ No newline at end of file
+// Not thread-safe
+template <typename T>
+using Rc = BasicRc<T, NonAtomicRefCount>;
+// Its count may be changed from several threads at once. The object itself is
+// not made any more thread-safe.
+template <typename T>
+using Arc = BasicRc<T, AtomicRefCount>;
@@ -0,0 +1,115 @@
+#include "Reactor.h"
+#include "Executor.h"
+#include "Task.h"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace
+{
+[[noreturn]] void throw_errno(char const *what)
+{
+    std::array<char, 1024> buf;
+    std::snprintf(buf.data(), buf.size(), "%s: %s", what, strerror(errno));
+    throw std::runtime_error(buf.data());
+}
+} // namespace
+
+Reactor::Reactor()
+    : epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+      event_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+{
+    if (epoll_fd == -1)
+        throw_errno("epoll_create1");
+    if (event_fd == -1)
+        throw_errno("eventfd");
+    // The eventfd is the only registration without a handler
+    epoll_event event{.events = EPOLLIN, .data = {.ptr = nullptr}};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &event) == -1)
+        throw_errno("epoll_ctl");
+}
+
+Reactor::~Reactor()
+{
+    if (close(event_fd) == -1)
+        perror("close event_fd: ");
+    if (close(epoll_fd) == -1)
+        perror("close epoll_fd: ");
+}
+
+void Reactor::add(int fd, uint32_t events, Handler &handler)
+{
+    epoll_event event{.events = events, .data = {.ptr = &handler}};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+        throw_errno("epoll_ctl");
+    ++number_of_registrations;
+}
+
+void Reactor::modify(int fd, uint32_t events, Handler &handler)
+{
+    epoll_event event{.events = events, .data = {.ptr = &handler}};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1)
+        throw_errno("epoll_ctl");
+}
+
+void Reactor::remove(int fd)
+{
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr) == -1)
+        throw_errno("epoll_ctl");
+    --number_of_registrations;
+}
+
+size_t Reactor::poll(Executor &executor, std::optional<Clock::duration> timeout)
+{
+    int timeout_ms = -1;
+    if (timeout)
+        // A negative timeout would mean forever, so deadlines further away
+        // than INT_MAX milliseconds (about 24.8 days) wait for that long
+        timeout_ms = static_cast<int>(std::min<int64_t>(
+            std::chrono::ceil<std::chrono::milliseconds>(*timeout).count(),
+            INT_MAX));
+    std::array<epoll_event, 64> events;
+    int const num_events = epoll_wait(
+        epoll_fd, events.data(), static_cast<int>(events.size()), timeout_ms);
+    if (num_events == -1)
+    {
+        if (errno == EINTR)
+            return 0;
+        throw_errno("epoll_wait");
+    }
+    size_t number_of_dispatched_handlers = 0;
+    for (epoll_event const &event :
+         std::span(events.begin(), events.begin() + num_events))
+    {
+        if (event.data.ptr == nullptr)
+        {
+            uint64_t count;
+            if (read(event_fd, &count, sizeof(count)) == -1 and
+                errno != EAGAIN)
+                throw_errno("read eventfd");
+            continue;
+        }
+        Handler *handler = static_cast<Handler *>(event.data.ptr);
+        std::unique_ptr<Task> task = handler->handle(executor, event.events);
+        if (task != nullptr)
+            executor.add_task(std::move(task));
+        ++number_of_dispatched_handlers;
+    }
+    return number_of_dispatched_handlers;
+}
+
+void Reactor::notify()
+{
+    uint64_t const count = 1;
+    if (write(event_fd, &count, sizeof(count)) == -1 and errno != EAGAIN)
+        throw_errno("write eventfd");
+}
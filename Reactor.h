@@ -0,0 +1,33 @@
+#pragma once
+#include "Executor.decl.h"
+#include "TimerHeap.h"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+class Handler;
+
+// Readiness notifications for an executor. Handlers registered here are
+// dispatched whenever the executor polls, and an executor with nothing to run
+// blocks in poll() instead of spinning. notify() may be called from any thread
+// to cut a blocking poll() short.
+class Reactor
+{
+    int epoll_fd;
+    int event_fd;
+    size_t number_of_registrations = 0;
+
+public:
+    Reactor();
+    Reactor(Reactor const &) = delete;
+    ~Reactor();
+    void add(int fd, uint32_t events, Handler &handler);
+    void modify(int fd, uint32_t events, Handler &handler);
+    void remove(int fd);
+    bool has_registrations() const { return number_of_registrations != 0; }
+    // Dispatches the handlers of ready file descriptors, first waiting up to
+    // timeout (forever if empty) for any to become ready. Returns the number
+    // of handlers dispatched.
+    size_t poll(Executor &executor, std::optional<Clock::duration> timeout);
+    void notify();
+};
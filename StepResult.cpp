@@ -20,11 +20,15 @@ Ready::Ready(std::vector<std::unique_ptr<Task>> child_tasks)
     : child_tasks(std::move(child_tasks))
 {
 }
-WaitForWaker::WaitForWaker(Waker &waker) : waker(waker) {}
+WaitForWaker::WaitForWaker(Waker &waker, bool at_front)
+    : waker(waker), at_front(at_front)
+{
+}
 WaitForChildTasks::WaitForChildTasks(std::vector<std::unique_ptr<Task>> tasks)
     : tasks(std::move(tasks))
 {
 }
+WaitUntil::WaitUntil(Clock::time_point deadline) : deadline(deadline) {}
 
 Wait::Wait(OnWaitFinish on_wait_finish,
            WaitFor wait_for)
@@ -42,4 +46,21 @@ Wait::Wait(OnWaitFinish on_wait_finish, Waker &waker)
     : on_wait_finish(on_wait_finish), wait_for(WaitForWaker(waker))
 {
 }
+
+Wait::Wait(OnWaitFinish on_wait_finish, Waker &waker,
+           Clock::time_point deadline)
+    : on_wait_finish(on_wait_finish), wait_for(WaitForWaker(waker)),
+      deadline(deadline)
+{
+}
+
+Wait sleep_until(Clock::time_point deadline)
+{
+    return Wait(Wait::task_not_done, WaitUntil(deadline));
+}
+
+Wait sleep_for(Clock::duration duration)
+{
+    return sleep_until(Clock::now() + duration);
+}
 }; // namespace step_result
\ No newline at end of file
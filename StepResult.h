@@ -25,7 +25,8 @@ struct Done
 };
 struct Ready
 {
-    // Go to front of executor rather than the back
+    // Go to the front of the run queue of the task's Priority rather than the
+    // back
     bool high_priority = false;
     // The child tasks, if non-empty, can be viewed as daemons.
     std::vector<std::unique_ptr<Task>> child_tasks;
@@ -37,14 +38,23 @@ struct Ready
 struct WaitForWaker
 {
     Waker &waker;
-    WaitForWaker(Waker &waker);
+    // Park at the head of the waker's queue rather than the tail, for a task
+    // that was woken but found what it was woken for already taken
+    bool at_front = false;
+    WaitForWaker(Waker &waker, bool at_front = false);
 };
 struct WaitForChildTasks
 {
     std::vector<std::unique_ptr<Task>> tasks;
     WaitForChildTasks(std::vector<std::unique_ptr<Task>> tasks);
 };
-using WaitFor = std::variant<WaitForWaker, WaitForChildTasks>;
+// Sleep until the deadline, without waiting on anything else
+struct WaitUntil
+{
+    Clock::time_point deadline;
+    WaitUntil(Clock::time_point deadline);
+};
+using WaitFor = std::variant<WaitForWaker, WaitForChildTasks, WaitUntil>;
 struct Wait
 {
     enum OnWaitFinish : bool
@@ -54,48 +64,48 @@ struct Wait
     };
     OnWaitFinish on_wait_finish;
     WaitFor wait_for;
+    // Only used with WaitForWaker. If the waker has not woken the task by the
+    // deadline, the task is woken anyway and SleepingTask::wait_timed_out()
+    // is set.
+    std::optional<Clock::time_point> deadline;
     Wait(OnWaitFinish on_wait_finish, WaitFor wait_for);
     Wait(OnWaitFinish on_wait_finish,
          std::vector<std::unique_ptr<Task>> child_tasks);
     Wait(OnWaitFinish on_wait_finish, Waker &waker);
+    Wait(OnWaitFinish on_wait_finish, Waker &waker,
+         Clock::time_point deadline);
 };
 
-// Used by composite tasks
+Wait sleep_until(Clock::time_point deadline);
+Wait sleep_for(Clock::duration duration);
+
+// Used by composite tasks. Subtask leaf_index of leaf_group waits as
+// described by wait. Once it is done waiting, it is marked ready in its group
+// and every group above it, and root_waker, the waker of the outermost group,
+// is woken.
 struct CompositeWait
 {
     bool all_subtasks_sleeping;
     Waker &root_waker;
-    SubtaskStatus &leaf_status;
-    std::vector<std::reference_wrapper<SubtaskStatus>> statuses;
+    SubtaskGroup &leaf_group;
+    size_t leaf_index;
+    // The waiting subtask's token, which may be its own rather than the
+    // group's. If it is cancelled, the wait ends with the subtask done.
+    Rc<CancellationToken> leaf_cancellation_token;
+    // The group whose waker root_waker is, which an enclosing group links to
+    // itself when passing the wait on
+    SubtaskGroup &outermost_group;
     Wait wait;
     CompositeWait(bool all_subtasks_sleeping, Waker &root_waker,
-                  SubtaskStatus &status, Wait wait)
+                  SubtaskGroup &leaf_group, size_t leaf_index,
+                  Rc<CancellationToken> leaf_cancellation_token,
+                  SubtaskGroup &outermost_group, Wait wait)
         : all_subtasks_sleeping(all_subtasks_sleeping), root_waker(root_waker),
-          leaf_status(status), wait(std::move(wait))
+          leaf_group(leaf_group), leaf_index(leaf_index),
+          leaf_cancellation_token(std::move(leaf_cancellation_token)),
+          outermost_group(outermost_group), wait(std::move(wait))
     {
     }
-
-    CompositeWait(bool all_subtasks_sleeping, Waker &root_waker,
-                  SubtaskStatus &status, CompositeWait composite_wait)
-        : all_subtasks_sleeping(all_subtasks_sleeping), root_waker(root_waker),
-          leaf_status(composite_wait.leaf_status),
-          statuses(
-              [&status, &composite_wait]
-              {
-                  composite_wait.statuses.push_back(std::ref(status));
-                  return std::move(composite_wait.statuses);
-              }()),
-          wait(std::move(composite_wait.wait))
-    {
-    }
-
-    CompositeWait(Waker &root_waker, CompositeWait composite_wait)
-        : all_subtasks_sleeping(composite_wait.all_subtasks_sleeping),
-        root_waker(root_waker),
-        leaf_status(composite_wait.leaf_status),
-        statuses(std::move(composite_wait.statuses)),
-        wait(std::move(composite_wait.wait))
-    {}
 };
 } // namespace step_result
 
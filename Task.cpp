@@ -1,57 +1,109 @@
 #include "Task.h"
 #include "Executor.h"
 #include "StepResult.h"
+#include <algorithm>
+#include <array>
 #include <cstring>
 #include <memory>
-#include <span>
 #include <stdexcept>
 #include <sys/epoll.h>
 
-StepResult Task::step(SingleThreadedExecutor &executor)
+StepResult Task::step(Executor &executor)
 {
     return step_result::Done();
 }
 
-StepResult Task::step_with_result(
-    SingleThreadedExecutor &executor,
-    std::vector<std::optional<std::unique_ptr<void, TypeErasedDeleter>>>
-        child_return_values)
+StepResult Task::step_with_result(Executor &executor,
+                                  ChildReturnValues child_return_values)
 {
     return step(executor);
 }
 
-void EpollTask::execute(SingleThreadedExecutor &executor)
+void Task::done(Executor &executor)
 {
-    std::array<epoll_event, 5> events;
-    int num_events;
-    if ((num_events = epoll_wait(epoll_fd, events.data(),
-                                 static_cast<int>(events.size()), 0)) == -1)
+    if (parent != nullptr and --parent->number_of_unfinished_children == 0)
+        executor.wake_sleeping_task(*parent);
+}
+
+EpollTask::ReadinessHandler::ReadinessHandler(EpollTask &task) : task(task)
+{
+    fd = task.epoll_fd;
+}
+
+std::unique_ptr<Task>
+EpollTask::ReadinessHandler::handle(Executor &executor,
+                                    uint32_t active_events [[maybe_unused]])
+{
+    task.waker.wake_one(executor);
+    return nullptr;
+}
+
+EpollTask::EpollTask(int epoll_fd, size_t initial_batch_size,
+                     size_t max_batch_size, size_t max_handlers_per_step)
+    : Task("EpollTask"), epoll_fd(epoll_fd), readiness_handler(*this),
+      events(std::max<size_t>(initial_batch_size, 1)),
+      max_batch_size(std::max(max_batch_size, events.size())),
+      max_handlers_per_step(std::max<size_t>(max_handlers_per_step, 1))
+{
+    // Dispatches I/O readiness, which should not wait behind background work
+    set_priority(Priority::latency_critical);
+}
+
+EpollTask::~EpollTask()
+{
+    if (reactor)
+        reactor->remove(epoll_fd);
+    if (close(epoll_fd) == -1)
+        perror("close epoll_fd: ");
+}
+
+bool EpollTask::execute(Executor &executor)
+{
+    if (next_event == number_of_events)
     {
-        std::array<char, 1024> buf;
-        std::snprintf(buf.data(), buf.size(), "%s", strerror(errno));
-        throw std::runtime_error(buf.data());
+        int num_events;
+        if ((num_events = epoll_wait(epoll_fd, events.data(),
+                                     static_cast<int>(events.size()), 0)) ==
+            -1)
+        {
+            std::array<char, 1024> buf;
+            std::snprintf(buf.data(), buf.size(), "%s", strerror(errno));
+            throw std::runtime_error(buf.data());
+        }
+        number_of_events = static_cast<size_t>(num_events);
+        next_event = 0;
+        if (number_of_events != 0)
+        {
+            ++stats.wakeups;
+            stats.events += number_of_events;
+            stats.max_events_per_wakeup =
+                std::max(stats.max_events_per_wakeup, number_of_events);
+        }
+        last_batch_was_full = number_of_events == events.size();
+        if (last_batch_was_full and events.size() < max_batch_size)
+            events.resize(std::min(events.size() * 2, max_batch_size));
     }
-    std::span<epoll_event> const returned_events(events.begin(),
-                                                 events.begin() + num_events);
-    for (epoll_event const &event : returned_events)
+    size_t const end =
+        std::min(number_of_events, next_event + max_handlers_per_step);
+    for (; next_event < end; ++next_event)
     {
+        epoll_event const &event = events[next_event];
         Handler *handler = reinterpret_cast<Handler *>(event.data.ptr);
-        std::unique_ptr<Task> task = handler->handle(event.events);
+        std::unique_ptr<Task> task = handler->handle(executor, event.events);
         if (task != nullptr)
             executor.add_task(std::move(task));
     }
+    return next_event != number_of_events or last_batch_was_full;
 }
 
-StepResult EpollTask::step(SingleThreadedExecutor &executor)
+StepResult EpollTask::step(Executor &executor)
 {
-    execute(executor);
-    return step_result::Ready();
-}
-
-SleepingTask::SleepingTask(std::unique_ptr<SleepingTask> next,
-                           std::unique_ptr<Task> task, bool destroy_on_wake)
-    : prev(), next(std::move(next)), task(std::move(task)),
-      destroy_on_wake(destroy_on_wake)
-{
-    this->next->prev = this;
+    if (reactor == nullptr)
+    {
+        reactor = &executor.get_reactor();
+        reactor->add(epoll_fd, EPOLLIN, readiness_handler);
+    }
+    if (execute(executor))
+        return step_result::Ready();
+    return step_result::Wait(step_result::Wait::task_not_done, waker);
 }
@@ -1,2 +1,16 @@
-struct SleepingTask;
-struct Task;
\ No newline at end of file
+#pragma once
+#include "utilities.h"
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+
+class SleepingTask;
+struct Task;
+enum class Priority : uint8_t;
+
+using ChildReturnValue =
+    std::optional<std::unique_ptr<void, TypeErasedDeleter>>;
+// The return values of the children a task waited for, in the order in which
+// the children were given
+using ChildReturnValues = std::span<ChildReturnValue>;
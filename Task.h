@@ -1,76 +1,170 @@
 #pragma once
+#include "Cancellation.h"
 #include "Executor.decl.h"
+#include "PoolAllocator.h"
+#include "Reactor.h"
 #include "StepResult.decl.h"
-#include "Waker.decl.h"
+#include "Task.decl.h"
+#include "TimerHeap.h"
+#include "Waker.h"
 #include "utilities.h"
 #include <cstdint>
 #include <cstdlib>
-#include <functional>
 #include <memory>
 #include <optional>
 #include <stdexcept>
+#include <string_view>
 #include <sys/epoll.h>
 #include <unistd.h>
-struct Task
-{
-    friend class SingleThreadedExecutor;
+#include <vector>
 
-private:
-    std::string name;
-    std::vector<std::function<void()>> on_done_callbacks;
-    std::optional<std::unique_ptr<void, TypeErasedDeleter>>
-        *parent_return_value_location = nullptr;
-    std::vector<std::optional<std::unique_ptr<void, TypeErasedDeleter>>>
-        last_child_return_values;
+class TraceBuffer;
 
-public:
-    Task(std::string name) : name(std::move(name)) {}
-    Task(Task const &) = delete;
-    Task(Task &&) noexcept = default;
-    virtual StepResult step(SingleThreadedExecutor &executor);
-    virtual StepResult step_with_result(
-        SingleThreadedExecutor &executor,
-        std::vector<std::optional<std::unique_ptr<void, TypeErasedDeleter>>>
-            child_return_values);
-    void done()
-    {
-        for (auto &callback : on_done_callbacks)
-            callback();
-    }
-    virtual ~Task() {}
+// Scheduling classes, most urgent first. Each has its own run queue, and the
+// executor shares steps between them by weight, so that a busy class slows
+// down the ones below it without starving them.
+enum class Priority : uint8_t
+{
+    // Such as continuations of I/O completions
+    latency_critical,
+    normal,
+    // Such as compaction or other housekeeping
+    background,
 };
+inline constexpr size_t number_of_priorities = 3;
 
+// Intrusive node through which an executor tracks a task while it is queued
+// to run or sleeps. Every Task is a SleepingTask, so neither queueing nor
+// parking a task allocates anything.
 class SleepingTask
 {
     friend class SingleThreadedExecutor;
+    friend class TimerHeap;
+    friend class FifoWaker;
+    friend class SingleTaskWaker;
+    // Links in the executor's run queue or sleeping list, never both at once
     SleepingTask *prev = nullptr;
-    std::unique_ptr<SleepingTask> next;
+    SleepingTask *next = nullptr;
+    // Links in the queue of the FifoWaker the task is parked on
+    SleepingTask *wait_queue_prev = nullptr;
+    SleepingTask *wait_queue_next = nullptr;
+    Waker *waker = nullptr;
+    Clock::time_point deadline;
+    // When the task was queued or put to sleep, only kept while the
+    // executor's stats are enabled
+    Clock::time_point stats_timestamp;
+    size_t timer_index = no_timer;
+    // Steps in a row after which the task went back to the front of the run
+    // queue, see SingleThreadedExecutor::set_step_budget
+    unsigned steps_at_front = 0;
+    bool is_sleeping = false;
+    bool timed_out = false;
+    // Raised by the wake that queued the task, for that run only, see
+    // SingleTaskWaker::wake_one
+    std::optional<Priority> wake_priority;
+    // The FifoWaker whose wake_one queued the task. If the task is cancelled
+    // before it runs, the wake goes to the waker's next waiter instead, so
+    // the waker must outlive the tasks it wakes until they run.
+    Waker *woken_by = nullptr;
 
 public:
-    std::unique_ptr<Task> task;
+    static constexpr size_t no_timer = SIZE_MAX;
     bool destroy_on_wake = false;
-    SleepingTask() : prev() {}
-    SleepingTask(std::unique_ptr<SleepingTask> next, std::unique_ptr<Task> task,
-                 bool destroy_on_wake);
+    SleepingTask() = default;
+    // Tasks are only moved before they are handed to an executor, so the
+    // moved-to task starts out unlinked.
+    SleepingTask(SleepingTask &&) noexcept {}
+    // Whether the last timed wait of the task ended because its deadline
+    // passed rather than because its waker woke it.
+    bool wait_timed_out() const { return timed_out; }
+    Task &task();
 };
 
-class EpollTask : public Task
+struct Task : public SleepingTask
 {
-    int epoll_fd;
+    friend class SingleThreadedExecutor;
+    friend class TraceBuffer;
 
-protected:
-    void execute(SingleThreadedExecutor &);
+private:
+    // Refers to static storage, typically a string literal, so that creating
+    // a task does not allocate a copy of its name
+    std::string_view name;
+    // Assigned by the TraceBuffer the first time the task is traced. The id
+    // is unique across buffers, so it stays when the task is stolen by
+    // another worker, but the name indexes into trace_buffer's names.
+    uint64_t trace_id = 0;
+    uint32_t trace_name = 0;
+    TraceBuffer const *trace_buffer = nullptr;
+    // Join of a parent that waits for its children: each child points at the
+    // parent, which sleeps until its count of unfinished children drops to 0.
+    // A task tree never leaves its executor's thread, so the count need not
+    // be atomic.
+    Task *parent = nullptr;
+    size_t number_of_unfinished_children = 0;
+    ChildReturnValue *parent_return_value_location = nullptr;
+    // Filled in by the children of the current join, handed to the next step
+    // and cleared after it. Keeps its capacity between joins.
+    std::vector<ChildReturnValue> last_child_return_values;
+    Rc<CancellationToken> cancellation_token;
+    // Unset means inherited from the parent, or normal for a root task
+    std::optional<Priority> priority;
 
 public:
-    EpollTask(int epoll_fd) : Task("EpollTask"), epoll_fd(epoll_fd) {}
-    StepResult step(SingleThreadedExecutor &) override;
-    ~EpollTask()
+    Task(std::string_view name) : name(name) {}
+    Task(Task const &) = delete;
+    Task(Task &&) noexcept = default;
+    // Tasks are small and short-lived, so they are recycled through the pool
+    // allocator instead of going through malloc each time.
+    static void *operator new(std::size_t size)
+    {
+        return pool_allocator::allocate(size);
+    }
+    static void operator delete(void *p, std::size_t size) noexcept
+    {
+        pool_allocator::deallocate(p, size);
+    }
+    virtual StepResult step(Executor &executor);
+    // child_return_values is empty unless the task has just been woken from
+    // waiting for child tasks, and is only valid during the call.
+    virtual StepResult step_with_result(Executor &executor,
+                                        ChildReturnValues child_return_values);
+    void done(Executor &executor);
+    // See CancellationToken. Set before handing the task to an executor.
+    void set_cancellation_token(Rc<CancellationToken> token)
     {
-        if (close(epoll_fd) == -1)
-            perror("close epoll_fd: ");
+        cancellation_token = std::move(token);
     }
+    Rc<CancellationToken> const &get_cancellation_token() const
+    {
+        return cancellation_token;
+    }
+    // Set before handing the task to an executor
+    void set_priority(Priority priority) { this->priority = priority; }
+    Priority get_priority() const
+    {
+        return priority.value_or(Priority::normal);
+    }
+    // Gives the task the cancellation token and priority of its parent,
+    // unless it has its own
+    void inherit_from(Task const &parent)
+    {
+        if (not cancellation_token)
+            cancellation_token = parent.cancellation_token;
+        if (not priority)
+            priority = parent.priority;
+    }
+    bool is_cancelled() const
+    {
+        return cancellation_token and cancellation_token->is_cancelled();
+    }
+    // Whether Executor::cancel should wake this sleeping task even though it
+    // is not cancelled itself, because it waits on behalf of a task that is
+    virtual bool wakes_on_cancel() const { return false; }
+    virtual ~Task() {}
 };
 
+inline Task &SleepingTask::task() { return static_cast<Task &>(*this); }
+
 class Handler
 {
 protected:
@@ -78,5 +172,61 @@ protected:
 
 public:
     // nullptr means no Task needed to be spawned
-    virtual std::unique_ptr<Task> handle(uint32_t active_events) = 0;
+    virtual std::unique_ptr<Task> handle(Executor &executor,
+                                         uint32_t active_events) = 0;
+    virtual ~Handler() {}
+};
+
+class EpollTask : public Task
+{
+    // Registered with the executor's reactor so that the EpollTask sleeps
+    // until its epoll instance has events, rather than polling every step
+    class ReadinessHandler final : public Handler
+    {
+        EpollTask &task;
+
+    public:
+        ReadinessHandler(EpollTask &task);
+        std::unique_ptr<Task> handle(Executor &executor,
+                                     uint32_t active_events) override;
+    };
+
+public:
+    struct Stats
+    {
+        // epoll_wait calls that returned at least one event
+        uint64_t wakeups = 0;
+        uint64_t events = 0;
+        size_t max_events_per_wakeup = 0;
+    };
+
+private:
+    int epoll_fd;
+    ReusableSingleTaskWaker waker;
+    ReadinessHandler readiness_handler;
+    Reactor *reactor = nullptr;
+    // Doubles whenever epoll_wait fills it, up to max_batch_size
+    std::vector<epoll_event> events;
+    size_t max_batch_size;
+    // Bounds the handler work done in one step, so that a large burst is
+    // spread over several steps instead of starving the other tasks
+    size_t max_handlers_per_step;
+    size_t number_of_events = 0;
+    size_t next_event = 0;
+    bool last_batch_was_full = false;
+    Stats stats;
+
+protected:
+    // Handles up to max_handlers_per_step events, fetching a new batch from
+    // the epoll instance once the previous one has been handled. Returns
+    // whether more events may be ready.
+    bool execute(Executor &);
+
+public:
+    EpollTask(int epoll_fd, size_t initial_batch_size = 64,
+              size_t max_batch_size = 4096, size_t max_handlers_per_step = 256);
+    EpollTask(EpollTask &&) = delete;
+    StepResult step(Executor &) override;
+    Stats const &get_stats() const { return stats; }
+    ~EpollTask();
 };
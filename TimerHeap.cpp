@@ -0,0 +1,68 @@
+#include "TimerHeap.h"
+#include "Task.h"
+#include <algorithm>
+
+namespace
+{
+constexpr size_t arity = 4;
+}
+
+void TimerHeap::place(size_t index, SleepingTask *sleeping_task)
+{
+    heap[index] = sleeping_task;
+    sleeping_task->timer_index = index;
+}
+
+void TimerHeap::sift_up(size_t index)
+{
+    SleepingTask *sleeping_task = heap[index];
+    while (index > 0)
+    {
+        size_t const parent = (index - 1) / arity;
+        if (not(sleeping_task->deadline < heap[parent]->deadline))
+            break;
+        place(index, heap[parent]);
+        index = parent;
+    }
+    place(index, sleeping_task);
+}
+
+void TimerHeap::sift_down(size_t index)
+{
+    SleepingTask *sleeping_task = heap[index];
+    while (true)
+    {
+        size_t const first_child = index * arity + 1;
+        if (first_child >= heap.size())
+            break;
+        size_t const last_child = std::min(first_child + arity, heap.size());
+        size_t earliest = first_child;
+        for (size_t child = first_child + 1; child < last_child; ++child)
+            if (heap[child]->deadline < heap[earliest]->deadline)
+                earliest = child;
+        if (not(heap[earliest]->deadline < sleeping_task->deadline))
+            break;
+        place(index, heap[earliest]);
+        index = earliest;
+    }
+    place(index, sleeping_task);
+}
+
+void TimerHeap::push(SleepingTask &sleeping_task)
+{
+    heap.push_back(&sleeping_task);
+    sift_up(heap.size() - 1);
+}
+
+void TimerHeap::remove(SleepingTask &sleeping_task)
+{
+    size_t const index = sleeping_task.timer_index;
+    sleeping_task.timer_index = SleepingTask::no_timer;
+    SleepingTask *last = heap.back();
+    heap.pop_back();
+    if (index == heap.size())
+        return;
+    place(index, last);
+    sift_up(index);
+    sift_down(last->timer_index);
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "Task.decl.h"
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// 4-ary min-heap of sleeping tasks ordered by SleepingTask::deadline. Each
+// task stores its own position in the heap, so a task that is woken before its
+// deadline can be removed in O(log n).
+class TimerHeap
+{
+    std::vector<SleepingTask *> heap;
+    void sift_up(size_t index);
+    void sift_down(size_t index);
+    void place(size_t index, SleepingTask *sleeping_task);
+
+public:
+    bool empty() const { return heap.empty(); }
+    size_t size() const { return heap.size(); }
+    SleepingTask &top() { return *heap.front(); }
+    void push(SleepingTask &sleeping_task);
+    void remove(SleepingTask &sleeping_task);
+    void pop() { remove(top()); }
+};
@@ -0,0 +1,168 @@
+#include "TraceBuffer.h"
+#include "Task.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <unordered_set>
+
+namespace
+{
+void write_json_string(std::ostream &out, std::string_view s)
+{
+    out << '"';
+    for (char c : s)
+    {
+        if (c == '"' or c == '\\')
+            out << '\\' << c;
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out << buf;
+        }
+        else
+            out << c;
+    }
+    out << '"';
+}
+
+std::atomic<uint64_t> next_task_id{1};
+
+char const *event_name(TraceBuffer::EventType type)
+{
+    switch (type)
+    {
+    case TraceBuffer::EventType::spawn:
+        return "spawn";
+    case TraceBuffer::EventType::step:
+        return "step";
+    case TraceBuffer::EventType::wait_for_waker:
+        return "wait for waker";
+    case TraceBuffer::EventType::wait_for_children:
+        return "wait for children";
+    case TraceBuffer::EventType::wait_until:
+        return "wait until";
+    case TraceBuffer::EventType::wake:
+        return "wake";
+    case TraceBuffer::EventType::done:
+        return "done";
+    case TraceBuffer::EventType::cancelled:
+        return "cancelled";
+    }
+    return "unknown";
+}
+} // namespace
+
+TraceBuffer::TraceBuffer(size_t capacity)
+    : first_task_id(next_task_id.load(std::memory_order_relaxed)),
+      events(std::bit_ceil(std::max<size_t>(capacity, 1)))
+{
+}
+
+bool TraceBuffer::is_identified(Task const &task) const
+{
+    return task.trace_id >= first_task_id;
+}
+
+void TraceBuffer::identify(Task &task)
+{
+    if (not is_identified(task))
+        task.trace_id = next_task_id.fetch_add(1, std::memory_order_relaxed);
+    auto [it, inserted] = name_indices.try_emplace(
+        task.name, static_cast<uint32_t>(names.size()));
+    if (inserted)
+        names.push_back(task.name);
+    task.trace_name = it->second;
+    task.trace_buffer = this;
+}
+
+void TraceBuffer::record(EventType type, Task &task, uint64_t argument,
+                         Clock::time_point at, Clock::duration duration)
+{
+    // A task stolen from another worker has its name registered there
+    if (not is_identified(task) or task.trace_buffer != this)
+        identify(task);
+    events[number_of_events++ & (events.size() - 1)] = {
+        static_cast<uint64_t>(
+            std::chrono::nanoseconds(at - start).count()),
+        static_cast<uint64_t>(std::chrono::nanoseconds(duration).count()),
+        task.trace_id,
+        argument,
+        task.trace_name,
+        type,
+    };
+}
+
+uint64_t TraceBuffer::task_id(Task &task)
+{
+    if (not is_identified(task) or task.trace_buffer != this)
+        identify(task);
+    return task.trace_id;
+}
+
+size_t TraceBuffer::size() const
+{
+    return std::min<uint64_t>(number_of_events, events.size());
+}
+
+void TraceBuffer::write_chrome_json(std::ostream &out) const
+{
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    char const *separator = "\n";
+    // Name the tracks after their tasks. Ids are handed out to every
+    // buffer's tasks from one counter, so they are collected from the events
+    // rather than indexed from first_task_id.
+    std::unordered_set<uint64_t> named;
+    uint64_t const first = number_of_events - size();
+    for (uint64_t i = first; i < number_of_events; ++i)
+    {
+        Event const &event = events[i & (events.size() - 1)];
+        if (named.insert(event.task_id).second)
+        {
+            out << separator
+                << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":"
+                << event.task_id << ",\"args\":{\"name\":";
+            write_json_string(out, std::string(names[event.name]) + " #" +
+                                       std::to_string(event.task_id));
+            out << "}}";
+            separator = ",\n";
+        }
+        out << separator << "{\"name\":\"" << event_name(event.type)
+            << "\",\"cat\":\"task\",\"pid\":1,\"tid\":" << event.task_id
+            << ",\"ts\":" << event.timestamp_ns / 1000.0;
+        if (event.type == EventType::step)
+            out << ",\"ph\":\"X\",\"dur\":" << event.duration_ns / 1000.0;
+        else
+            out << ",\"ph\":\"i\",\"s\":\"t\"";
+        out << ",\"args\":{\"task\":";
+        write_json_string(out, names[event.name]);
+        switch (event.type)
+        {
+        case EventType::spawn:
+            if (event.argument != 0)
+                out << ",\"parent\":" << event.argument;
+            break;
+        case EventType::wait_for_waker:
+        {
+            char buf[32];
+            std::snprintf(buf, sizeof(buf), "%#llx",
+                          static_cast<unsigned long long>(event.argument));
+            out << ",\"waker\":\"" << buf << '"';
+            break;
+        }
+        case EventType::wait_for_children:
+            out << ",\"children\":" << event.argument;
+            break;
+        case EventType::wake:
+            out << ",\"timed_out\":" << (event.argument ? "true" : "false");
+            break;
+        default:
+            break;
+        }
+        out << "}}";
+    }
+    out << "\n]}\n";
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include "Task.decl.h"
+#include "TimerHeap.h"
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Ring buffer of scheduling events, written by the executor while tracing is
+// enabled and exported in the Chrome trace event format, which both
+// chrome://tracing and ui.perfetto.dev load. Every task gets a stable id the
+// first time it is traced and is shown as its own track, with its steps as
+// slices and everything else as instant events.
+// Only the executor's thread writes to the buffer, so recording an event is a
+// plain store into the next slot. Once full, the oldest events are
+// overwritten.
+class TraceBuffer
+{
+public:
+    enum class EventType : uint8_t
+    {
+        spawn,
+        step,
+        wait_for_waker,
+        wait_for_children,
+        wait_until,
+        wake,
+        done,
+        cancelled,
+    };
+
+    struct Event
+    {
+        // Since the buffer was created
+        uint64_t timestamp_ns;
+        // Only for steps
+        uint64_t duration_ns;
+        uint64_t task_id;
+        // The waker's address for wait_for_waker, the number of children for
+        // wait_for_children, the parent's id for spawn, whether the wait
+        // timed out for wake
+        uint64_t argument;
+        // Index into names
+        uint32_t name;
+        EventType type;
+    };
+
+private:
+    Clock::time_point start = Clock::now();
+    // Task ids are unique across buffers, so that a task traced by an earlier
+    // buffer is recognisable by an id below first_task_id
+    uint64_t first_task_id;
+    // Power of 2 in size, slot i % size holds the ith event
+    std::vector<Event> events;
+    uint64_t number_of_events = 0;
+    // Task names refer to static storage, so they can be kept as views
+    std::unordered_map<std::string_view, uint32_t> name_indices;
+    std::vector<std::string_view> names;
+
+    // Gives the task an id unless it has one from this or a later buffer,
+    // and registers its name with this buffer
+    void identify(Task &task);
+
+public:
+    explicit TraceBuffer(size_t capacity = 1 << 16);
+    // Whether the task has been seen by this buffer
+    bool is_identified(Task const &task) const;
+    // The id of the task, assigning one if it has not been traced yet
+    uint64_t task_id(Task &task);
+    void record(EventType type, Task &task, uint64_t argument = 0,
+                Clock::time_point at = Clock::now(),
+                Clock::duration duration = {});
+    // Events that have been overwritten are not included
+    size_t size() const;
+    void write_chrome_json(std::ostream &out) const;
+};
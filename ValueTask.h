@@ -0,0 +1,35 @@
+#pragma once
+#include "StepResult.h"
+#include "Task.h"
+#include <memory>
+#include <optional>
+#include <utility>
+
+// A task with a statically typed return value. A coroutine that co_awaits it
+// lends it a slot in the coroutine frame, and the value is written straight
+// into that slot instead of being boxed. Any other parent still receives the
+// value type-erased through step_with_result.
+template <typename ReturnTypeT>
+class ValueTask : public Task
+{
+    std::optional<ReturnTypeT> *return_value_slot = nullptr;
+
+public:
+    using UnambiguousReturnType = ReturnTypeT;
+    using Task::Task;
+    void set_return_value_slot(std::optional<ReturnTypeT> &slot)
+    {
+        return_value_slot = &slot;
+    }
+
+protected:
+    // The step result with which the task returns return_value
+    step_result::Done done_with(ReturnTypeT return_value)
+    {
+        if (return_value_slot == nullptr)
+            return step_result::Done(
+                std::make_unique<ReturnTypeT>(std::move(return_value)));
+        return_value_slot->emplace(std::move(return_value));
+        return {};
+    }
+};
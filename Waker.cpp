@@ -1,27 +1,70 @@
 #include "Waker.h"
 #include "Executor.h"
-bool FifoWaker::has_waiters() { return not wait_queue.empty(); }
+#include <utility>
+bool FifoWaker::has_waiters() { return head != nullptr; }
 
 void FifoWaker::add_waiter(SleepingTask &sleeping_task)
 {
-    wait_queue.push(sleeping_task);
+    sleeping_task.wait_queue_prev = tail;
+    sleeping_task.wait_queue_next = nullptr;
+    if (tail)
+        tail->wait_queue_next = &sleeping_task;
+    else
+        head = &sleeping_task;
+    tail = &sleeping_task;
 }
 
-void FifoWaker::wake_one(SingleThreadedExecutor &executor)
+void FifoWaker::add_waiter_at_front(SleepingTask &sleeping_task)
 {
-    if (wait_queue.empty())
+    sleeping_task.wait_queue_prev = nullptr;
+    sleeping_task.wait_queue_next = head;
+    if (head)
+        head->wait_queue_prev = &sleeping_task;
+    else
+        tail = &sleeping_task;
+    head = &sleeping_task;
+}
+
+void FifoWaker::remove_waiter(SleepingTask &sleeping_task)
+{
+    if (sleeping_task.wait_queue_prev)
+        sleeping_task.wait_queue_prev->wait_queue_next =
+            sleeping_task.wait_queue_next;
+    else
+        head = sleeping_task.wait_queue_next;
+    if (sleeping_task.wait_queue_next)
+        sleeping_task.wait_queue_next->wait_queue_prev =
+            sleeping_task.wait_queue_prev;
+    else
+        tail = sleeping_task.wait_queue_prev;
+    sleeping_task.wait_queue_prev = nullptr;
+    sleeping_task.wait_queue_next = nullptr;
+}
+
+SleepingTask &FifoWaker::pop()
+{
+    SleepingTask &sleeping_task = *head;
+    remove_waiter(sleeping_task);
+    return sleeping_task;
+}
+
+void FifoWaker::wake_one(Executor &executor)
+{
+    if (head == nullptr)
         return;
-    executor.wake_sleeping_task(wait_queue.front());
-    wait_queue.pop();
+    SleepingTask &sleeping_task = pop();
+    sleeping_task.woken_by = this;
+    executor.wake_sleeping_task(sleeping_task);
 }
 
-void FifoWaker::wake_all(SingleThreadedExecutor &executor)
+void FifoWaker::wake_all(Executor &executor)
 {
-    while (not wait_queue.empty())
-    {
-        executor.wake_sleeping_task(wait_queue.front());
-        wait_queue.pop();
-    }
+    // The whole queue is handed over as it is, so that waking it is O(1)
+    // and waiters added afterwards stay for the next wake
+    if (head == nullptr)
+        return;
+    SleepingTask &first = *std::exchange(head, nullptr);
+    executor.wake_sleeping_tasks(first, *std::exchange(tail, nullptr));
 }
 
 void SingleTaskWaker::add_waiter(SleepingTask &sleeping_task)
@@ -31,7 +74,13 @@ void SingleTaskWaker::add_waiter(SleepingTask &sleeping_task)
     this->sleeping_task = &sleeping_task;
 }
 
-void SingleTaskWaker::wake_one(SingleThreadedExecutor &executor)
+void SingleTaskWaker::remove_waiter(SleepingTask &sleeping_task)
+{
+    if (this->sleeping_task == &sleeping_task)
+        this->sleeping_task = nullptr;
+}
+
+void SingleTaskWaker::wake_one(Executor &executor)
 {
     if (sleeping_task == nullptr)
         return;
@@ -39,12 +88,21 @@ void SingleTaskWaker::wake_one(SingleThreadedExecutor &executor)
     executor.wake_sleeping_task(*sleeping_task);
 }
 
-void SingleTaskWaker::wake_all(SingleThreadedExecutor &executor)
+void SingleTaskWaker::wake_one(Executor &executor, Priority priority)
+{
+    if (sleeping_task == nullptr)
+        return;
+
+    sleeping_task->wake_priority = priority;
+    wake_one(executor);
+}
+
+void SingleTaskWaker::wake_all(Executor &executor)
 {
     wake_one(executor);
 }
 
-void ReusableSingleTaskWaker::wake_one(SingleThreadedExecutor &executor)
+void ReusableSingleTaskWaker::wake_one(Executor &executor)
 {
     SingleTaskWaker::wake_one(executor);
     sleeping_task = nullptr;
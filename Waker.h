@@ -1,7 +1,6 @@
 #pragma once
 #include "Executor.decl.h"
 #include "Task.decl.h"
-#include <queue>
 #include <stdexcept>
 
 class Waker
@@ -10,8 +9,15 @@ protected:
 public:
     virtual bool has_waiters() = 0;
     virtual void add_waiter(SleepingTask &sleeping_task) = 0;
-    virtual void wake_one(SingleThreadedExecutor &executor) = 0;
-    virtual void wake_all(SingleThreadedExecutor &executor) = 0;
+    // Ahead of the waiters already queued, where the waker keeps an order
+    virtual void add_waiter_at_front(SleepingTask &sleeping_task)
+    {
+        add_waiter(sleeping_task);
+    }
+    // Used when a timed wait expires before the task is woken
+    virtual void remove_waiter(SleepingTask &sleeping_task) = 0;
+    virtual void wake_one(Executor &executor) = 0;
+    virtual void wake_all(Executor &executor) = 0;
     virtual ~Waker(){};
 };
 
@@ -25,18 +31,25 @@ public:
     }
     bool has_waiters() override { return false; }
     void add_waiter(SleepingTask &sleeping_task) override {}
-    void wake_one(SingleThreadedExecutor &executor) override {}
-    void wake_all(SingleThreadedExecutor &executor) override {}
+    void remove_waiter(SleepingTask &sleeping_task) override {}
+    void wake_one(Executor &executor) override {}
+    void wake_all(Executor &executor) override {}
 };
 class FifoWaker final : public Waker
 {
-    std::queue<std::reference_wrapper<SleepingTask>> wait_queue; // no nullptrs
+    // Intrusive queue threaded through the waiting tasks
+    SleepingTask *head = nullptr;
+    SleepingTask *tail = nullptr;
+    SleepingTask &pop();
+
 public:
     FifoWaker() = default;
     bool has_waiters() override;
     void add_waiter(SleepingTask &sleeping_task) override;
-    void wake_one(SingleThreadedExecutor &executor) override;
-    void wake_all(SingleThreadedExecutor &executor) override;
+    void add_waiter_at_front(SleepingTask &sleeping_task) override;
+    void remove_waiter(SleepingTask &sleeping_task) override;
+    void wake_one(Executor &executor) override;
+    void wake_all(Executor &executor) override;
 };
 
 class SingleTaskWaker : public Waker
@@ -48,13 +61,20 @@ public:
     SingleTaskWaker() = default;
     bool has_waiters() override { return sleeping_task != nullptr; }
     void add_waiter(SleepingTask &sleeping_task) override;
-    void wake_one(SingleThreadedExecutor &executor) override;
-    void wake_all(SingleThreadedExecutor &executor) override;
+    void remove_waiter(SleepingTask &sleeping_task) override;
+    void wake_one(Executor &executor) override;
+    // Queues the woken task in the given class if that is more urgent than
+    // its own, until it next runs. Used for wakes from the reactor or a
+    // completion, so that the continuation of I/O does not wait behind the
+    // background work of its executor.
+    void wake_one(Executor &executor, Priority priority);
+    void wake_all(Executor &executor) override;
 };
 
 class ReusableSingleTaskWaker final : public SingleTaskWaker
 {
 public:
     ReusableSingleTaskWaker() = default;
-    void wake_one(SingleThreadedExecutor &executor) override;
+    using SingleTaskWaker::wake_one;
+    void wake_one(Executor &executor) override;
 };
@@ -0,0 +1,233 @@
+#include "WorkStealingExecutor.h"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+namespace
+{
+struct CurrentWorker
+{
+    WorkStealingExecutor *executor = nullptr;
+    size_t index = 0;
+};
+thread_local CurrentWorker current_worker_of_thread;
+} // namespace
+
+WorkStealingExecutor::WorkStealingExecutor(size_t number_of_workers)
+{
+    if (number_of_workers == 0)
+        number_of_workers = std::max(1u, std::thread::hardware_concurrency());
+    workers.reserve(number_of_workers);
+    for (size_t i = 0; i < number_of_workers; ++i)
+        workers.push_back(std::make_unique<Worker>());
+}
+
+WorkStealingExecutor::~WorkStealingExecutor()
+{
+    for (auto &worker : workers)
+        while (std::optional<Task *> task = worker->run_queue.pop())
+            delete *task;
+}
+
+WorkStealingExecutor::Worker *WorkStealingExecutor::current_worker()
+{
+    if (current_worker_of_thread.executor != this)
+        return nullptr;
+    return workers[current_worker_of_thread.index].get();
+}
+
+void WorkStealingExecutor::print_tasks()
+{
+    for (auto &worker : workers)
+        worker->local.print_tasks();
+}
+
+void WorkStealingExecutor::add_task(std::unique_ptr<Task> task)
+{
+    number_of_queued_tasks.fetch_add(1, std::memory_order_relaxed);
+    if (Worker *worker = current_worker())
+    {
+        worker->run_queue.push(task.release());
+        // Pairs with the fence in wait_for_work: either a worker about to
+        // block sees the task, or we see that worker and wake it to steal
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (number_of_waiting_workers.load(std::memory_order_relaxed) != 0)
+            for (auto &other : workers)
+                if (other.get() != worker)
+                    other->local.get_reactor().notify();
+    }
+    else
+    {
+        {
+            std::lock_guard lock(injection_mutex);
+            injection_queue.push_back(std::move(task));
+        }
+        // Workers may be blocked waiting for I/O or timers
+        for (auto &worker : workers)
+            worker->local.get_reactor().notify();
+    }
+}
+
+void WorkStealingExecutor::wake_sleeping_task(SleepingTask &sleeping_task)
+{
+    Worker *worker = current_worker();
+    if (worker == nullptr)
+        throw std::runtime_error("Sleeping tasks must be woken by their worker");
+    worker->local.wake_sleeping_task(sleeping_task);
+}
+
+void WorkStealingExecutor::wake_sleeping_tasks(SleepingTask &first,
+                                               SleepingTask &last)
+{
+    Worker *worker = current_worker();
+    if (worker == nullptr)
+        throw std::runtime_error("Sleeping tasks must be woken by their worker");
+    worker->local.wake_sleeping_tasks(first, last);
+}
+
+void WorkStealingExecutor::cancel(CancellationToken &token)
+{
+    Worker *worker = current_worker();
+    if (worker == nullptr)
+        throw std::runtime_error("Tasks must be cancelled by their worker");
+    worker->local.cancel(token);
+}
+
+Reactor &WorkStealingExecutor::get_reactor()
+{
+    Worker *worker = current_worker();
+    if (worker == nullptr)
+        throw std::runtime_error("Reactors belong to worker threads");
+    return worker->local.get_reactor();
+}
+
+std::unique_ptr<Task> WorkStealingExecutor::acquire_task(size_t worker_index)
+{
+    if (number_of_queued_tasks.load(std::memory_order_relaxed) == 0)
+        return nullptr;
+    std::unique_ptr<Task> task;
+    Worker &worker = *workers[worker_index];
+    if (std::optional<Task *> own = worker.run_queue.pop())
+        task.reset(*own);
+    if (not task)
+    {
+        std::lock_guard lock(injection_mutex);
+        if (not injection_queue.empty())
+        {
+            task = std::move(injection_queue.front());
+            injection_queue.pop_front();
+            // Move a share of the remaining injected tasks to our run queue
+            // so that other idle workers can steal them from us.
+            size_t const share = injection_queue.size() / workers.size();
+            for (size_t i = 0; i < share; ++i)
+            {
+                worker.run_queue.push(injection_queue.front().release());
+                injection_queue.pop_front();
+            }
+        }
+    }
+    for (size_t i = 1; not task and i < workers.size(); ++i)
+    {
+        Worker &victim = *workers[(worker_index + i) % workers.size()];
+        if (std::optional<Task *> stolen = victim.run_queue.steal())
+            task.reset(*stolen);
+    }
+    if (task)
+        number_of_queued_tasks.fetch_sub(1, std::memory_order_relaxed);
+    return task;
+}
+
+void WorkStealingExecutor::run_worker(size_t worker_index)
+{
+    current_worker_of_thread = {this, worker_index};
+    Worker &worker = *workers[worker_index];
+    bool is_busy = true;
+    number_of_busy_workers.fetch_add(1, std::memory_order_acq_rel);
+    while (true)
+    {
+        // Never blocks, so that a worker whose tasks all sleep still picks
+        // up queued work instead of waiting for their timers or I/O first
+        ExecutorStepResult const result = worker.local.step(false);
+        if (result == ExecutorStepResult::more_to_go)
+            continue;
+        if (not is_busy)
+        {
+            // Mark ourselves busy before looking for work so that no other
+            // worker concludes that everything is done while we hold a task
+            // that is in neither a queue nor a local executor.
+            is_busy = true;
+            number_of_busy_workers.fetch_add(1, std::memory_order_acq_rel);
+        }
+        if (std::unique_ptr<Task> task = acquire_task(worker_index))
+        {
+            worker.local.add_task(std::move(task));
+            continue;
+        }
+        if (result == ExecutorStepResult::waiting)
+        {
+            // Still busy, since the sleeping tasks may add more work
+            wait_for_work(worker_index);
+            continue;
+        }
+        is_busy = false;
+        number_of_busy_workers.fetch_sub(1, std::memory_order_acq_rel);
+        if (number_of_busy_workers.load(std::memory_order_acquire) == 0 and
+            number_of_queued_tasks.load(std::memory_order_acquire) == 0)
+            break;
+        std::this_thread::yield();
+    }
+    current_worker_of_thread = {};
+}
+
+void WorkStealingExecutor::wait_for_work(size_t worker_index)
+{
+    Worker &worker = *workers[worker_index];
+    number_of_waiting_workers.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (std::unique_ptr<Task> task = acquire_task(worker_index))
+        worker.local.add_task(std::move(task));
+    else
+        worker.local.wait_for_work();
+    number_of_waiting_workers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+ExecutorStepResult WorkStealingExecutor::step()
+{
+    current_worker_of_thread = {this, 0};
+    Worker &worker = *workers[0];
+    ExecutorStepResult result = worker.local.step(false);
+    if (result != ExecutorStepResult::more_to_go)
+    {
+        if (std::unique_ptr<Task> task = acquire_task(0))
+        {
+            worker.local.add_task(std::move(task));
+            result = ExecutorStepResult::more_to_go;
+        }
+        else if (result == ExecutorStepResult::waiting)
+        {
+            wait_for_work(0);
+            result = ExecutorStepResult::more_to_go;
+        }
+    }
+    current_worker_of_thread = {};
+    return result;
+}
+
+void WorkStealingExecutor::run_until_completion()
+{
+    {
+        std::vector<std::jthread> threads;
+        threads.reserve(workers.size() - 1);
+        for (size_t i = 1; i < workers.size(); ++i)
+            threads.emplace_back([this, i] { run_worker(i); });
+        run_worker(0);
+    }
+    // Every worker has run out of work, so anything left is asleep for good
+    for (auto &worker : workers)
+        if (size_t const n = worker->local.number_of_sleeping_tasks())
+        {
+            std::cerr << "Warning: " << n << " tasks sleeping\n";
+            worker->local.print_tasks();
+        }
+}
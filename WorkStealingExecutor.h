@@ -0,0 +1,67 @@
+#pragma once
+#include "ChaseLevDeque.h"
+#include "Executor.h"
+#include "Task.h"
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Runs independent task trees on all cores.
+// Every worker thread owns a SingleThreadedExecutor that steps the tasks it has
+// adopted, plus a Chase-Lev run queue of tasks that have not been started yet.
+// Idle workers take from their own run queue, then from the injection queue
+// fed by other threads, and finally steal from the top of a busy worker's run
+// queue. Once a task has been started it stays on its worker, since wakers,
+// Rc and the child-task bookkeeping are not thread-safe. Tasks added here must
+// therefore not share state with tasks that may run on another worker.
+// Only the tasks added to this executor can be stolen. The child tasks they
+// spawn, through step results or the executor passed to step(), run on the
+// worker of their parent, so a single tree that fans out does not spread
+// across cores. Add its independent parts here as separate tasks instead.
+class WorkStealingExecutor final : public Executor
+{
+    struct Worker
+    {
+        ChaseLevDeque<Task *> run_queue;
+        SingleThreadedExecutor local;
+    };
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex injection_mutex;
+    std::deque<std::unique_ptr<Task>> injection_queue;
+    // Tasks sitting in run queues or the injection queue
+    std::atomic<size_t> number_of_queued_tasks{0};
+    // Workers that may still add tasks
+    std::atomic<size_t> number_of_busy_workers{0};
+    // Workers blocked until their timers or I/O, which a worker that queues
+    // a task wakes so that they can steal it
+    std::atomic<size_t> number_of_waiting_workers{0};
+
+    Worker *current_worker();
+    std::unique_ptr<Task> acquire_task(size_t worker_index);
+    // Blocks the worker until its executor has something to do, unless a
+    // task can be acquired after all
+    void wait_for_work(size_t worker_index);
+    void run_worker(size_t worker_index);
+
+public:
+    explicit WorkStealingExecutor(size_t number_of_workers = 0);
+    WorkStealingExecutor(WorkStealingExecutor const &) = delete;
+    void print_tasks() override;
+    void add_task(std::unique_ptr<Task>) override;
+    // Only valid on a worker thread, where it forwards to the worker's own
+    // executor (which is where the sleeping task is registered).
+    void wake_sleeping_task(SleepingTask &sleeping_task) override;
+    void wake_sleeping_tasks(SleepingTask &first, SleepingTask &last) override;
+    // Likewise, so a task tree must be cancelled from the worker it runs on
+    void cancel(CancellationToken &token) override;
+    // Likewise the reactor of the calling worker
+    Reactor &get_reactor() override;
+    // Steps worker 0 on the calling thread. Must not be called concurrently
+    // with run_until_completion.
+    ExecutorStepResult step() override;
+    void run_until_completion() override;
+    ~WorkStealingExecutor();
+};
@@ -0,0 +1,388 @@
+#include "CompositeTask.h"
+#include "ConditionVariable.h"
+#include "CoroutineTask.h"
+#include "Executor.h"
+#include "Mutex.h"
+#include "StepResult.h"
+#include "Task.h"
+#include "Waker.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <new>
+#include <string_view>
+
+// Microbenchmarks of the executor primitives. Each benchmark runs a fixed
+// workload on a fresh SingleThreadedExecutor and reports the time per
+// operation and per executor step, and the number of heap allocations per
+// operation. Allocations are counted by replacing the global operator new,
+// so allocations served from the pool allocator's cache are not counted, and
+// neither are those made while add_tasks sets the workload up. A workload
+// that finishes within one step has no meaningful time per step, shown as -.
+// Build with optimisations, e.g. make bench CXX_FLAGS=-O2
+
+namespace
+{
+std::atomic<size_t> number_of_allocations{0};
+} // namespace
+
+void *operator new(std::size_t size)
+{
+    number_of_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size == 0 ? 1 : size))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+namespace
+{
+using BenchClock = std::chrono::steady_clock;
+
+// Runs the tasks added by add_tasks to completion, counting operations as
+// reported by the benchmark
+template <typename AddTasksT>
+void run_benchmark(char const *name, size_t operations, AddTasksT add_tasks)
+{
+    SingleThreadedExecutor executor;
+    add_tasks(executor);
+    size_t const allocations_before =
+        number_of_allocations.load(std::memory_order_relaxed);
+    size_t steps = 0;
+    auto const start = BenchClock::now();
+    ExecutorStepResult result;
+    while ((result = executor.step()) == ExecutorStepResult::more_to_go)
+        ++steps;
+    auto const elapsed = BenchClock::now() - start;
+    size_t const allocations =
+        number_of_allocations.load(std::memory_order_relaxed) -
+        allocations_before;
+    if (result != ExecutorStepResult::done)
+        std::fprintf(stderr, "%s: tasks left sleeping\n", name);
+    double const ns =
+        std::chrono::duration<double, std::nano>(elapsed).count();
+    std::array<char, 16> ns_per_step{"-"};
+    if (steps > 1)
+        std::snprintf(ns_per_step.data(), ns_per_step.size(), "%.1f",
+                      ns / steps);
+    std::printf("%-28s %10zu %12.0f %10.1f %10s %10.2f\n", name, operations,
+                operations / ns * 1e9, ns / operations, ns_per_step.data(),
+                static_cast<double>(allocations) / operations);
+}
+
+struct BenchTask;
+struct BenchTaskPromiseType final : PromiseType<BenchTaskPromiseType, BenchTask>
+{
+    static std::string_view get_name() { return "BenchTask"; }
+};
+struct BenchTask final : public CoroutineTask<BenchTaskPromiseType>
+{
+    BenchTask(std::string_view name, promise_type &promise)
+        : CoroutineTask(name, promise)
+    {
+    }
+};
+
+class ReadyLoopTask final : public Task
+{
+    size_t remaining;
+
+public:
+    ReadyLoopTask(size_t iterations)
+        : Task("ReadyLoopTask"), remaining(iterations)
+    {
+    }
+    StepResult step(Executor &) override
+    {
+        if (remaining-- == 0)
+            return step_result::Done();
+        return step_result::Ready();
+    }
+};
+
+std::unique_ptr<BenchTask> ready_loop_coroutine(size_t iterations)
+{
+    for (size_t i = 0; i < iterations; ++i)
+        co_yield step_result::Ready();
+}
+
+class LeafTask final : public Task
+{
+public:
+    LeafTask() : Task("LeafTask") {}
+    StepResult step(Executor &) override { return step_result::Done(); }
+};
+
+class SpawnJoinTask final : public Task
+{
+    size_t remaining;
+    size_t fan_out;
+
+public:
+    SpawnJoinTask(size_t iterations, size_t fan_out)
+        : Task("SpawnJoinTask"), remaining(iterations), fan_out(fan_out)
+    {
+    }
+    StepResult step(Executor &) override
+    {
+        if (remaining-- == 0)
+            return step_result::Done();
+        std::vector<std::unique_ptr<Task>> children;
+        children.reserve(fan_out);
+        for (size_t i = 0; i < fan_out; ++i)
+            children.push_back(std::make_unique<LeafTask>());
+        return step_result::Wait(step_result::Wait::task_not_done,
+                                 std::move(children));
+    }
+};
+
+std::unique_ptr<BenchTask> lock_loop(Mutex &mutex, size_t iterations,
+                                     bool yield_while_locked)
+{
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        co_await mutex.lock();
+        if (yield_while_locked)
+            co_yield step_result::Ready();
+        mutex.unlock(co_await executor_awaiter);
+    }
+}
+
+struct PingPong
+{
+    Mutex mutex;
+    ConditionVariable cv;
+    unsigned turn = 0;
+};
+
+std::unique_ptr<BenchTask> ping_pong_player(PingPong &state, unsigned player,
+                                            size_t rounds)
+{
+    for (size_t i = 0; i < rounds; ++i)
+    {
+        co_await state.mutex.lock();
+        while (state.turn != player)
+            co_yield step_result::Wait(
+                step_result::Wait::task_not_done,
+                make_vector_unique<Task>(
+                    ConditionVariableWaitTask(state.mutex, state.cv)));
+        state.turn = 1 - player;
+        Executor &executor = co_await executor_awaiter;
+        state.cv.waker->wake_all(executor);
+        state.mutex.unlock(executor);
+    }
+}
+
+// The producer/consumer scenario of enqueue_task and dequeue_task in
+// main.cpp, without their printing and with a bound on the queue
+struct BoundedQueue
+{
+    Mutex mutex;
+    ConditionVariable not_empty;
+    ConditionVariable not_full;
+    std::deque<int> items;
+    size_t capacity;
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+};
+
+std::unique_ptr<BenchTask> producer(BoundedQueue &queue, size_t items)
+{
+    for (size_t i = 0; i < items; ++i)
+    {
+        co_await queue.mutex.lock();
+        while (queue.items.size() == queue.capacity)
+            co_yield step_result::Wait(
+                step_result::Wait::task_not_done,
+                make_vector_unique<Task>(ConditionVariableWaitTask(
+                    queue.mutex, queue.not_full)));
+        queue.items.push_back(static_cast<int>(i));
+        Executor &executor = co_await executor_awaiter;
+        queue.not_empty.waker->wake_one(executor);
+        queue.mutex.unlock(executor);
+    }
+}
+
+std::unique_ptr<BenchTask> consumer(BoundedQueue &queue, size_t items)
+{
+    for (size_t i = 0; i < items; ++i)
+    {
+        co_await queue.mutex.lock();
+        while (queue.items.empty())
+            co_yield step_result::Wait(
+                step_result::Wait::task_not_done,
+                make_vector_unique<Task>(ConditionVariableWaitTask(
+                    queue.mutex, queue.not_empty)));
+        queue.items.pop_front();
+        Executor &executor = co_await executor_awaiter;
+        queue.not_full.waker->wake_one(executor);
+        queue.mutex.unlock(executor);
+    }
+}
+
+struct Broadcast
+{
+    FifoWaker waker;
+    size_t number_of_sleepers = 0;
+};
+
+// Sleeps on the waker, rounds times
+class BroadcastWaiterTask final : public Task
+{
+    Broadcast &broadcast;
+    size_t remaining;
+
+public:
+    BroadcastWaiterTask(Broadcast &broadcast, size_t rounds)
+        : Task("BroadcastWaiterTask"), broadcast(broadcast), remaining(rounds)
+    {
+    }
+    StepResult step(Executor &) override
+    {
+        if (remaining-- == 0)
+            return step_result::Done();
+        ++broadcast.number_of_sleepers;
+        return step_result::Wait(step_result::Wait::task_not_done,
+                                 broadcast.waker);
+    }
+};
+
+// Wakes all waiters at once, every time they have all gone back to sleep
+class BroadcasterTask final : public Task
+{
+    Broadcast &broadcast;
+    size_t waiters;
+    size_t remaining;
+
+public:
+    BroadcasterTask(Broadcast &broadcast, size_t waiters, size_t rounds)
+        : Task("BroadcasterTask"), broadcast(broadcast), waiters(waiters),
+          remaining(rounds)
+    {
+    }
+    StepResult step(Executor &executor) override
+    {
+        if (broadcast.number_of_sleepers == waiters)
+        {
+            broadcast.number_of_sleepers = 0;
+            broadcast.waker.wake_all(executor);
+            if (--remaining == 0)
+                return step_result::Done();
+        }
+        return step_result::Ready();
+    }
+};
+
+class YieldOnceTask final : public Task
+{
+    bool yielded = false;
+
+public:
+    YieldOnceTask() : Task("YieldOnceTask") {}
+    StepResult step(Executor &) override
+    {
+        if (std::exchange(yielded, true))
+            return step_result::Done();
+        return step_result::Ready();
+    }
+};
+
+class FanOutTask final : public Task
+{
+    size_t remaining;
+
+public:
+    FanOutTask(size_t iterations) : Task("FanOutTask"), remaining(iterations)
+    {
+    }
+    StepResult step(Executor &) override
+    {
+        if (remaining-- == 0)
+            return step_result::Done();
+        return step_result::Wait(
+            step_result::Wait::task_not_done,
+            make_vector_unique<Task>(make_independent_tasks(
+                YieldOnceTask(), YieldOnceTask(), YieldOnceTask(),
+                YieldOnceTask(), YieldOnceTask(), YieldOnceTask(),
+                YieldOnceTask(), YieldOnceTask())));
+    }
+};
+} // namespace
+
+int main(int argc, char const **argv)
+{
+    size_t const n = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+    std::printf("%-28s %10s %12s %10s %10s %10s\n", "benchmark", "ops",
+                "ops/s", "ns/op", "ns/step", "allocs/op");
+
+    run_benchmark("ready_loop_task", n, [n](Executor &executor)
+                  { executor.add_task(std::make_unique<ReadyLoopTask>(n)); });
+    run_benchmark("ready_loop_coroutine", n, [n](Executor &executor)
+                  { executor.add_task(ready_loop_coroutine(n)); });
+
+    size_t const fan_out = 4;
+    run_benchmark("spawn_join_child", n / fan_out * fan_out,
+                  [n, fan_out](Executor &executor)
+                  {
+                      executor.add_task(
+                          std::make_unique<SpawnJoinTask>(n / fan_out, fan_out));
+                  });
+
+    Mutex uncontended;
+    run_benchmark("mutex_uncontended", n, [&, n](Executor &executor)
+                  { executor.add_task(lock_loop(uncontended, n, false)); });
+
+    size_t const contenders = 4;
+    Mutex contended;
+    run_benchmark("mutex_contended", n / contenders * contenders,
+                  [&, n](Executor &executor)
+                  {
+                      for (size_t i = 0; i < contenders; ++i)
+                          executor.add_task(
+                              lock_loop(contended, n / contenders, true));
+                  });
+
+    PingPong ping_pong;
+    size_t const rounds = n / 10;
+    run_benchmark("condition_variable_pingpong", 2 * rounds,
+                  [&](Executor &executor)
+                  {
+                      executor.add_task(ping_pong_player(ping_pong, 0, rounds));
+                      executor.add_task(ping_pong_player(ping_pong, 1, rounds));
+                  });
+
+    BoundedQueue queue(16);
+    size_t const items = n / 10;
+    run_benchmark("queue_producer_consumer", items,
+                  [&](Executor &executor)
+                  {
+                      executor.add_task(consumer(queue, items / 2));
+                      executor.add_task(consumer(queue, items / 2));
+                      executor.add_task(producer(queue, items));
+                  });
+
+    Broadcast broadcast;
+    size_t const waiters = 1000;
+    size_t const broadcasts = std::max<size_t>(n / waiters, 1);
+    run_benchmark("broadcast_wake", waiters * broadcasts,
+                  [&](Executor &executor)
+                  {
+                      for (size_t i = 0; i < waiters; ++i)
+                          executor.add_task(
+                              std::make_unique<BroadcastWaiterTask>(
+                                  broadcast, broadcasts));
+                      executor.add_task(std::make_unique<BroadcasterTask>(
+                          broadcast, waiters, broadcasts));
+                  });
+
+    size_t const fan_outs = n / 8;
+    run_benchmark("independent_tasks_fan_out", fan_outs * 8,
+                  [fan_outs](Executor &executor)
+                  { executor.add_task(std::make_unique<FanOutTask>(fan_outs)); });
+}
@@ -1,17 +1,31 @@
+#include "AsyncSocket.h"
 #include "CompositeTask.h"
 #include "ConditionVariable.h"
 #include "CoroutineTask.h"
 #include "Executor.h"
+#include "IoUringTask.h"
 #include "Mutex.h"
 #include "Rc.h"
 #include "StepResult.h"
 #include "Task.h"
+#include "ValueTask.h"
+#include "WorkStealingExecutor.h"
 #include "utilities.h"
 
 #include <algorithm>
+#include <cerrno>
 #include <cstdlib>
+#include <iostream>
 #include <memory>
+#include <netinet/in.h>
+#include <queue>
+#include <span>
+#include <sstream>
 #include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <utility>
 
 template <typename T>
 struct MutexCvObject
@@ -35,7 +49,7 @@ public:
         : Task("DequeueTask"), queue(queue)
     {
     }
-    StepResult step(SingleThreadedExecutor &executor) override
+    StepResult step(Executor &executor) override
     {
         switch (state++)
         {
@@ -77,7 +91,7 @@ public:
         : Task("GuaranteedDequeueTask"), queue(queue)
     {
     }
-    StepResult step(SingleThreadedExecutor &executor) override
+    StepResult step(Executor &executor) override
     {
         switch (state)
         {
@@ -118,7 +132,7 @@ public:
         : Task("EnqueueTask"), queue(queue), element(element)
     {
     }
-    StepResult step(SingleThreadedExecutor &executor) override
+    StepResult step(Executor &executor) override
     {
         switch (state++)
         {
@@ -172,7 +186,7 @@ public:
             queue, std::move(elements_to_enqueue), Stage::acquire);
     }
 
-    StepResult step(SingleThreadedExecutor &) override
+    StepResult step(Executor &) override
     {
         switch (stage)
         {
@@ -216,7 +230,7 @@ class MainTask final : public Task
 
 public:
     MainTask() : Task("MainTask") {}
-    StepResult step(SingleThreadedExecutor &executor) override
+    StepResult step(Executor &executor) override
     {
         switch (state++)
         {
@@ -265,7 +279,7 @@ public:
         : Task("DequeueTask"), queue(std::move(queue))
     {
     }
-    StepResult step(SingleThreadedExecutor &executor) override
+    StepResult step(Executor &executor) override
     {
         switch (state++)
         {
@@ -307,7 +321,7 @@ public:
         : Task("GuaranteedDequeueTask"), queue(std::move(queue))
     {
     }
-    StepResult step(SingleThreadedExecutor &executor) override
+    StepResult step(Executor &executor) override
     {
         switch (state)
         {
@@ -349,7 +363,7 @@ public:
         : Task("EnqueueTask"), queue(std::move(queue)), element(element)
     {
     }
-    StepResult step(SingleThreadedExecutor &executor) override
+    StepResult step(Executor &executor) override
     {
         switch (state++)
         {
@@ -414,7 +428,7 @@ public:
                                 EnqueueTaskChain<chain_mode>::Stage::acquire);
     }
 
-    StepResult step(SingleThreadedExecutor &) override
+    StepResult step(Executor &) override
     {
         switch (stage)
         {
@@ -459,7 +473,7 @@ public:
         : Task("MainTask"), queue(Rc<MutexCvObject<std::queue<int>>>::create())
     {
     }
-    StepResult step(SingleThreadedExecutor &executor) override
+    StepResult step(Executor &executor) override
     {
         switch (state++)
         {
@@ -502,22 +516,28 @@ struct DequeueTask;
 struct DequeueTaskPromiseType final
     : PromiseType<DequeueTaskPromiseType, DequeueTask>
 {
-    static std::string get_name() { return "DequeueTaskPromiseType"; }
+    static std::string_view get_name() { return "DequeueTaskPromiseType"; }
 };
 struct DequeueTask final : public CoroutineTask<DequeueTaskPromiseType>
 {
-    DequeueTask(std::string name, promise_type &promise)
-        : CoroutineTask(std::move(name), promise)
+    DequeueTask(std::string_view name, promise_type &promise)
+        : CoroutineTask(name, promise)
     {
     }
 };
 
+// The tasks lock either through the mutex acquire tasks or by awaiting
+// Mutex::lock()
+template <bool await_lock>
 std::unique_ptr<DequeueTask>
 dequeue_task(Rc<MutexCvObject<std::queue<int>>> queue)
 {
-    co_yield step_result::Wait(step_result::Wait::task_not_done,
-                               make_vector_unique<Task>(mutex_acquire_task(
-                                   Rc<Mutex>(queue, &queue->mutex))));
+    if constexpr (await_lock)
+        co_await queue->mutex.lock();
+    else
+        co_yield step_result::Wait(step_result::Wait::task_not_done,
+                                   make_vector_unique<Task>(mutex_acquire_task(
+                                       Rc<Mutex>(queue, &queue->mutex))));
 
     if (queue->object.empty())
     {
@@ -537,21 +557,28 @@ struct GuaranteedDequeueTask;
 struct GuaranteedDequeueTaskPromiseType final
     : PromiseType<GuaranteedDequeueTaskPromiseType, GuaranteedDequeueTask>
 {
-    static std::string get_name() { return "GuaranteedDequeueTaskPromiseType"; }
+    static std::string_view get_name()
+    {
+        return "GuaranteedDequeueTaskPromiseType";
+    }
 };
 struct GuaranteedDequeueTask : CoroutineTask<GuaranteedDequeueTaskPromiseType>
 {
-    GuaranteedDequeueTask(std::string name, promise_type &promise)
-        : CoroutineTask(std::move(name), promise)
+    GuaranteedDequeueTask(std::string_view name, promise_type &promise)
+        : CoroutineTask(name, promise)
     {
     }
 };
+template <bool await_lock>
 std::unique_ptr<GuaranteedDequeueTask>
 guaranteed_dequeue_task(Rc<MutexCvObject<std::queue<int>>> queue)
 {
-    co_yield step_result::Wait(step_result::Wait::task_not_done,
-                               make_vector_unique<Task>(mutex_acquire_task(
-                                   Rc<Mutex>(queue, &queue->mutex))));
+    if constexpr (await_lock)
+        co_await queue->mutex.lock();
+    else
+        co_yield step_result::Wait(step_result::Wait::task_not_done,
+                                   make_vector_unique<Task>(mutex_acquire_task(
+                                       Rc<Mutex>(queue, &queue->mutex))));
 
     while (queue->object.empty())
         co_yield step_result::Wait(
@@ -570,22 +597,26 @@ struct EnqueueTask;
 struct EnqueueTaskPromiseType final
     : PromiseType<EnqueueTaskPromiseType, EnqueueTask>
 {
-    static std::string get_name() { return "EnqueueTaskPromiseType"; }
+    static std::string_view get_name() { return "EnqueueTaskPromiseType"; }
 };
 struct EnqueueTask final : public CoroutineTask<EnqueueTaskPromiseType>
 {
-    EnqueueTask(std::string name, promise_type &promise)
-        : CoroutineTask(std::move(name), promise)
+    EnqueueTask(std::string_view name, promise_type &promise)
+        : CoroutineTask(name, promise)
     {
     }
 };
 
+template <bool await_lock>
 std::unique_ptr<EnqueueTask>
 enqueue_task(Rc<MutexCvObject<std::queue<int>>> queue, int element)
 {
-    co_yield step_result::Wait(step_result::Wait::task_not_done,
-                               make_vector_unique<Task>(mutex_acquire_task(
-                                   Rc<Mutex>(queue, &queue->mutex))));
+    if constexpr (await_lock)
+        co_await queue->mutex.lock();
+    else
+        co_yield step_result::Wait(step_result::Wait::task_not_done,
+                                   make_vector_unique<Task>(mutex_acquire_task(
+                                       Rc<Mutex>(queue, &queue->mutex))));
 
     queue->object.push(element);
     co_yield step_result::Wait(
@@ -599,24 +630,28 @@ struct EnqueueTaskChain;
 struct EnqueueTaskChainPromiseType final
     : PromiseType<EnqueueTaskChainPromiseType, EnqueueTaskChain>
 {
-    static std::string get_name() { return "EnqueueTaskChainPromiseType"; }
+    static std::string_view get_name() { return "EnqueueTaskChainPromiseType"; }
 };
 struct EnqueueTaskChain final
     : public CoroutineTask<EnqueueTaskChainPromiseType>
 {
-    EnqueueTaskChain(std::string name, promise_type &promise)
-        : CoroutineTask(std::move(name), promise)
+    EnqueueTaskChain(std::string_view name, promise_type &promise)
+        : CoroutineTask(name, promise)
     {
     }
 };
 
+template <bool await_lock>
 std::unique_ptr<EnqueueTaskChain>
 enqueue_task_chain(Rc<MutexCvObject<std::queue<int>>> queue,
                    std::vector<int> elements_to_enqueue)
 {
-    co_yield step_result::Wait(step_result::Wait::task_not_done,
-                               make_vector_unique<Task>(RcMutexAcquireTask(
-                                   Rc<Mutex>(queue, &queue->mutex))));
+    if constexpr (await_lock)
+        co_await queue->mutex.lock();
+    else
+        co_yield step_result::Wait(step_result::Wait::task_not_done,
+                                   make_vector_unique<Task>(RcMutexAcquireTask(
+                                       Rc<Mutex>(queue, &queue->mutex))));
 
     for (int element : elements_to_enqueue)
     {
@@ -633,27 +668,28 @@ enqueue_task_chain(Rc<MutexCvObject<std::queue<int>>> queue,
 struct MainTask;
 struct MainTaskPromiseType final : PromiseType<MainTaskPromiseType, MainTask>
 {
-    static std::string get_name() { return "MainTask"; }
+    static std::string_view get_name() { return "MainTask"; }
 };
 struct MainTask final : public CoroutineTask<MainTaskPromiseType>
 {
-    MainTask(std::string name, promise_type &promise)
-        : CoroutineTask(std::move(name), promise)
+    MainTask(std::string_view name, promise_type &promise)
+        : CoroutineTask(name, promise)
     {
     }
 };
 
+template <bool await_lock>
 std::unique_ptr<MainTask> main_task()
 {
     auto queue = Rc<MutexCvObject<std::queue<int>>>::create();
     {
-        auto chain1 = enqueue_task_chain(queue, {1, 2, 3, 4});
-        auto chain2 = enqueue_task_chain(queue, {1, 2, 3, 4, 5});
-        auto chain3 =
-            enqueue_task_chain(queue, {1, 2, 3, 4, 5, 6, 7, 8, 9, 10});
-        auto chain4 = enqueue_task(queue, 100);
-        auto dequeue1 = guaranteed_dequeue_task(queue);
-        auto dequeue2 = guaranteed_dequeue_task(queue);
+        auto chain1 = enqueue_task_chain<await_lock>(queue, {1, 2, 3, 4});
+        auto chain2 = enqueue_task_chain<await_lock>(queue, {1, 2, 3, 4, 5});
+        auto chain3 = enqueue_task_chain<await_lock>(
+            queue, {1, 2, 3, 4, 5, 6, 7, 8, 9, 10});
+        auto chain4 = enqueue_task<await_lock>(queue, 100);
+        auto dequeue1 = guaranteed_dequeue_task<await_lock>(queue);
+        auto dequeue2 = guaranteed_dequeue_task<await_lock>(queue);
         co_yield step_result::Wait(
             step_result::Wait::task_not_done,
             make_vector_unique<Task>(std::move(chain1), std::move(chain2),
@@ -663,7 +699,7 @@ std::unique_ptr<MainTask> main_task()
     {
         std::vector<std::unique_ptr<Task>> tasks;
         for (int i = 0; i < 18; ++i)
-            tasks.emplace_back(guaranteed_dequeue_task(queue));
+            tasks.emplace_back(guaranteed_dequeue_task<await_lock>(queue));
         co_yield step_result::Wait(step_result::Wait::task_automatically_done,
                                    std::move(tasks));
     }
@@ -673,21 +709,20 @@ std::unique_ptr<MainTask> main_task()
 namespace return_type_test
 {
 template <typename ReturnTypeT>
-class ReturnTask final : public Task
+class ReturnTask final : public ValueTask<ReturnTypeT>
 {
     ReturnTypeT return_value;
 
 public:
-    using UnambiguousReturnType = ReturnTypeT;
     ReturnTask(ReturnTypeT return_value = {})
-        : Task("ReturnTask"), return_value(std::move(return_value))
+        : ValueTask<ReturnTypeT>("ReturnTask"),
+          return_value(std::move(return_value))
     {
     }
 
-    StepResult step(SingleThreadedExecutor &executor) override
+    StepResult step(Executor &executor) override
     {
-        return step_result::Done(
-            std::make_unique<ReturnTypeT>(std::move(return_value)));
+        return this->done_with(std::move(return_value));
     }
 };
 
@@ -695,10 +730,10 @@ template <typename ReturnTypeT>
 struct CoroReturnTask;
 template <typename ReturnTypeT>
 struct CoroReturnTaskPromiseType final
-    : public PromiseTypeWithReturnValue<CoroReturnTaskPromiseType<ReturnTypeT>,
-                                        CoroReturnTask<ReturnTypeT>>
+    : public ValuePromiseType<CoroReturnTaskPromiseType<ReturnTypeT>,
+                              CoroReturnTask<ReturnTypeT>, ReturnTypeT>
 {
-    static std::string get_name() { return "CoroReturnTaskPromiseType"; }
+    static std::string_view get_name() { return "CoroReturnTaskPromiseType"; }
 };
 
 template <typename ReturnTypeT>
@@ -707,9 +742,8 @@ struct CoroReturnTask final
 {
     using promise_type = CoroReturnTaskPromiseType<ReturnTypeT>;
     using UnambiguousReturnType = ReturnTypeT;
-    CoroReturnTask(std::string name, promise_type &promise)
-        : CoroutineTask<CoroReturnTaskPromiseType<ReturnTypeT>>(std::move(name),
-                                                                promise)
+    CoroReturnTask(std::string_view name, promise_type &promise)
+        : CoroutineTask<CoroReturnTaskPromiseType<ReturnTypeT>>(name, promise)
     {
     }
 };
@@ -718,18 +752,63 @@ template <typename ReturnTypeT>
 std::unique_ptr<CoroReturnTask<ReturnTypeT>>
 return_task(ReturnTypeT return_value)
 {
-    co_return std::make_unique<ReturnTypeT>(std::move(return_value));
+    co_return return_value;
+}
+
+template <typename ReturnTypeT>
+std::unique_ptr<CoroReturnTask<ReturnTypeT>>
+yield_done_task(ReturnTypeT return_value)
+{
+    co_yield step_result::Done(
+        std::make_unique<ReturnTypeT>(std::move(return_value)));
+    throw std::runtime_error("Unreachable");
+}
+
+std::unique_ptr<CoroReturnTask<int>> throwing_task()
+{
+    throw std::runtime_error("Child failed");
+    co_return 0;
+}
+
+// Returns its value boxed, so awaiting it gives a std::unique_ptr
+template <typename ReturnTypeT>
+struct BoxedReturnTask;
+template <typename ReturnTypeT>
+struct BoxedReturnTaskPromiseType final
+    : public PromiseTypeWithReturnValue<BoxedReturnTaskPromiseType<ReturnTypeT>,
+                                        BoxedReturnTask<ReturnTypeT>>
+{
+    static std::string_view get_name() { return "BoxedReturnTask"; }
+};
+
+template <typename ReturnTypeT>
+struct BoxedReturnTask final
+    : public CoroutineTask<BoxedReturnTaskPromiseType<ReturnTypeT>>
+{
+    using promise_type = BoxedReturnTaskPromiseType<ReturnTypeT>;
+    using UnambiguousReturnType = ReturnTypeT;
+    BoxedReturnTask(std::string_view name, promise_type &promise)
+        : CoroutineTask<BoxedReturnTaskPromiseType<ReturnTypeT>>(name, promise)
+    {
+    }
+};
+
+template <typename ReturnTypeT>
+std::unique_ptr<BoxedReturnTask<ReturnTypeT>>
+boxed_return_task(ReturnTypeT return_value)
+{
+    co_return return_value;
 }
 
 struct MainTask;
 struct MainTaskPromiseType final : PromiseType<MainTaskPromiseType, MainTask>
 {
-    static std::string get_name() { return "MainTask"; }
+    static std::string_view get_name() { return "MainTask"; }
 };
 struct MainTask final : public CoroutineTask<MainTaskPromiseType>
 {
-    MainTask(std::string name, promise_type &promise)
-        : CoroutineTask(std::move(name), promise)
+    MainTask(std::string_view name, promise_type &promise)
+        : CoroutineTask(name, promise)
     {
     }
 };
@@ -737,15 +816,46 @@ struct MainTask final : public CoroutineTask<MainTaskPromiseType>
 std::unique_ptr<MainTask> main_task()
 {
     {
-        std::unique_ptr<std::string> ret_val =
+        std::string ret_val =
             co_await std::make_unique<ReturnTask<std::string>>("Hello");
-        std::cout << *ret_val << '\n';
+        std::cout << ret_val << '\n';
     }
     {
-        std::unique_ptr<std::string> ret_val =
-            co_await return_task<std::string>("world");
+        std::string ret_val = co_await return_task<std::string>("world");
+        std::cout << ret_val << '\n';
+    }
+    {
+        int ret_val = co_await return_task(42);
+        std::cout << ret_val << '\n';
+    }
+    {
+        std::unique_ptr<int> ret_val = co_await boxed_return_task(43);
         std::cout << *ret_val << '\n';
     }
+    {
+        int ret_val = co_await yield_done_task(44);
+        std::cout << ret_val << '\n';
+    }
+    try
+    {
+        co_await throwing_task();
+    }
+    catch (std::runtime_error const &error)
+    {
+        std::cout << "Caught: " << error.what() << '\n';
+    }
+    try
+    {
+        auto cancelled = std::make_unique<ReturnTask<int>>(45);
+        Rc<CancellationToken> token = Rc<CancellationToken>::create();
+        token->cancel();
+        cancelled->set_cancellation_token(std::move(token));
+        co_await std::move(cancelled);
+    }
+    catch (std::runtime_error const &error)
+    {
+        std::cout << "Caught: " << error.what() << '\n';
+    }
 }
 } // namespace return_type_test
 
@@ -763,7 +873,7 @@ struct MainTask final : public Task
         : Task("MainTask"), queue(Rc<MutexCvObject<std::queue<int>>>::create())
     {
     }
-    StepResult step(SingleThreadedExecutor &executor) override
+    StepResult step(Executor &executor) override
     {
         switch (state++)
         {
@@ -796,6 +906,501 @@ struct MainTask final : public Task
 };
 } // namespace composite_task_test
 
+namespace timer_test
+{
+using namespace std::chrono_literals;
+
+struct MainTask;
+struct MainTaskPromiseType final : PromiseType<MainTaskPromiseType, MainTask>
+{
+    static std::string_view get_name() { return "MainTask"; }
+};
+struct MainTask final : public CoroutineTask<MainTaskPromiseType>
+{
+    MainTask(std::string_view name, promise_type &promise)
+        : CoroutineTask(name, promise)
+    {
+    }
+};
+
+std::unique_ptr<MainTask> main_task()
+{
+    Mutex mutex;
+    ConditionVariable cv;
+    auto const start = Clock::now();
+    co_yield step_result::sleep_for(10ms);
+    std::cerr << "Slept 10ms: " << (Clock::now() - start >= 10ms) << '\n';
+
+    co_await mutex.lock();
+    bool const acquired = co_await std::make_unique<TimedMutexAcquireTask>(
+        mutex, Clock::now() + 5ms);
+    std::cerr << "Acquired held mutex: " << acquired << '\n';
+
+    bool const notified =
+        co_await std::make_unique<TimedConditionVariableWaitTask>(
+            mutex, cv, Clock::now() + 5ms);
+    std::cerr << "Notified: " << notified << '\n';
+    mutex.unlock(co_await executor_awaiter);
+}
+} // namespace timer_test
+
+namespace io_uring_test
+{
+using namespace std::chrono_literals;
+
+struct MainTask;
+struct MainTaskPromiseType final : PromiseType<MainTaskPromiseType, MainTask>
+{
+    static std::string_view get_name() { return "MainTask"; }
+};
+struct MainTask final : public CoroutineTask<MainTaskPromiseType>
+{
+    MainTask(std::string_view name, promise_type &promise)
+        : CoroutineTask(name, promise)
+    {
+    }
+};
+
+// Reads from a pipe nobody writes to, until it is cancelled
+std::unique_ptr<MainTask> blocked_read_task(IoUringTask &ring, int fd)
+{
+    std::array<char, 64> buf;
+    co_await ring.read(fd, std::as_writable_bytes(std::span(buf)));
+    std::cerr << "Unreachable\n";
+}
+
+std::unique_ptr<MainTask> main_task(IoUringTask &ring,
+                                    Rc<CancellationToken> reader_token)
+{
+    int fds[2];
+    if (pipe(fds) == -1)
+        throw std::runtime_error("pipe failed");
+    std::string_view const message = "Hello from io_uring";
+    int32_t const written =
+        co_await ring.write(fds[1], std::as_bytes(std::span(message)));
+    std::cerr << "Written: " << written << '\n';
+
+    std::array<char, 64> buf;
+    int32_t const read =
+        co_await ring.read(fds[0], std::as_writable_bytes(std::span(buf)));
+    std::cerr << "Read: " << std::string_view(buf.data(), std::max(read, 0))
+              << '\n';
+
+    auto const start = Clock::now();
+    int32_t const timed_out = co_await ring.timeout(5ms);
+    std::cerr << "Timed out after 5ms: "
+              << (timed_out == -ETIME and Clock::now() - start >= 5ms) << '\n';
+    close(fds[0]);
+    close(fds[1]);
+
+    // The blocked read is cancelled in the kernel before its buffer goes
+    // with the reader's frame, and the ring can stop without it
+    Executor &executor = co_await executor_awaiter;
+    executor.cancel(*reader_token);
+    ring.stop();
+}
+} // namespace io_uring_test
+
+namespace async_socket_test
+{
+struct MainTask;
+struct MainTaskPromiseType final : PromiseType<MainTaskPromiseType, MainTask>
+{
+    static std::string_view get_name() { return "MainTask"; }
+};
+struct MainTask final : public CoroutineTask<MainTaskPromiseType>
+{
+    MainTask(std::string_view name, promise_type &promise)
+        : CoroutineTask(name, promise)
+    {
+    }
+};
+
+std::unique_ptr<MainTask> echo_server(int listening_fd)
+{
+    Executor &executor = co_await executor_awaiter;
+    AsyncSocket listener(executor.get_reactor(), listening_fd);
+    int const fd = co_await listener.accept();
+    if (fd < 0)
+        throw std::runtime_error("accept failed");
+    AsyncSocket connection(executor.get_reactor(), fd);
+    std::array<std::byte, 64> buf;
+    ssize_t const read = co_await connection.read(buf);
+    co_await connection.write(std::span(buf).first(std::max(read, 0L)));
+}
+
+std::unique_ptr<MainTask> client(sockaddr_in address)
+{
+    Executor &executor = co_await executor_awaiter;
+    int const fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) ==
+        -1)
+        throw std::runtime_error("connect failed");
+    AsyncSocket connection(executor.get_reactor(), fd);
+    std::string_view const message = "Hello from AsyncSocket";
+    co_await connection.write(std::as_bytes(std::span(message)));
+    std::array<char, 64> buf;
+    ssize_t const read =
+        co_await connection.read(std::as_writable_bytes(std::span(buf)));
+    std::cerr << "Echoed: " << std::string_view(buf.data(), std::max(read, 0L))
+              << '\n';
+}
+} // namespace async_socket_test
+
+namespace cancellation_test
+{
+using namespace std::chrono_literals;
+
+size_t live_tasks = 0;
+size_t sleeping_tasks = 0;
+
+struct SleepForeverTask final : public Task
+{
+    FifoWaker &waker;
+    SleepForeverTask(FifoWaker &waker) : Task("SleepForeverTask"), waker(waker)
+    {
+        ++live_tasks;
+    }
+    SleepForeverTask(SleepForeverTask &&other)
+        : Task(std::move(other)), waker(other.waker)
+    {
+        ++live_tasks;
+    }
+    ~SleepForeverTask() { --live_tasks; }
+    StepResult step(Executor &executor) override
+    {
+        ++sleeping_tasks;
+        return step_result::Wait(step_result::Wait::task_not_done, waker);
+    }
+};
+
+struct ParentTask final : public Task
+{
+    FifoWaker waker;
+    ParentTask() : Task("ParentTask") { ++live_tasks; }
+    ~ParentTask() { --live_tasks; }
+    StepResult step(Executor &executor) override
+    {
+        ++sleeping_tasks;
+        std::vector<std::unique_ptr<Task>> children;
+        children.push_back(std::make_unique<SleepForeverTask>(waker));
+        children.push_back(std::make_unique<SleepForeverTask>(waker));
+        children.push_back(make_independent_tasks(SleepForeverTask(waker),
+                                                  SleepForeverTask(waker)));
+        return step_result::Wait(step_result::Wait::task_not_done,
+                                 std::move(children));
+    }
+};
+
+struct TimerTask final : public Task
+{
+    TimerTask() : Task("TimerTask") { ++live_tasks; }
+    ~TimerTask() { --live_tasks; }
+    StepResult step(Executor &executor) override
+    {
+        ++sleeping_tasks;
+        return step_result::sleep_for(1h);
+    }
+};
+
+struct CancelTask final : public Task
+{
+    Rc<CancellationToken> token;
+    size_t sleepers;
+    CancelTask(Rc<CancellationToken> token, size_t sleepers)
+        : Task("CancelTask"), token(std::move(token)), sleepers(sleepers)
+    {
+    }
+    StepResult step(Executor &executor) override
+    {
+        if (sleeping_tasks < sleepers)
+            return step_result::Ready();
+        std::cerr << "Cancelling " << live_tasks << " tasks\n";
+        executor.cancel(*token);
+        return step_result::Done();
+    }
+};
+} // namespace cancellation_test
+
+namespace priority_test
+{
+std::array<size_t, number_of_priorities> steps_by_priority{};
+size_t total_steps = 0;
+
+// Counts its steps by priority during the first two rounds of the executor's
+// weighted round robin
+struct BusyTask final : public Task
+{
+    size_t remaining;
+    BusyTask(size_t steps) : Task("BusyTask"), remaining(steps) {}
+    StepResult step(Executor &executor) override
+    {
+        if (total_steps++ < 41)
+            ++steps_by_priority[static_cast<size_t>(get_priority())];
+        if (--remaining == 0)
+            return step_result::Done();
+        return step_result::Ready();
+    }
+};
+
+struct BackgroundParentTask final : public Task
+{
+    BackgroundParentTask() : Task("BackgroundParentTask")
+    {
+        set_priority(Priority::background);
+    }
+    StepResult step(Executor &executor) override
+    {
+        // The child is background too
+        return step_result::Done(make_vector_unique<Task>(BusyTask(100)));
+    }
+};
+} // namespace priority_test
+
+namespace step_budget_test
+{
+size_t steps = 0;
+
+// Tries to keep the executor to itself
+struct HogTask final : public Task
+{
+    size_t remaining;
+    HogTask(size_t steps) : Task("HogTask"), remaining(steps) {}
+    StepResult step(Executor &executor) override
+    {
+        ++steps;
+        if (--remaining == 0)
+            return step_result::Done();
+        return step_result::Ready(true);
+    }
+};
+
+struct OtherTask final : public Task
+{
+    OtherTask() : Task("OtherTask") {}
+    StepResult step(Executor &executor) override
+    {
+        ++steps;
+        std::cerr << "Other task ran at step " << steps << '\n';
+        return step_result::Done();
+    }
+};
+} // namespace step_budget_test
+
+namespace sleeper_test
+{
+using namespace std::chrono_literals;
+
+struct SleeperTask final : public Task
+{
+    bool has_slept = false;
+    SleeperTask() : Task("SleeperTask") {}
+    StepResult step(Executor &executor) override
+    {
+        if (has_slept)
+            return step_result::Done();
+        has_slept = true;
+        return step_result::sleep_for(50ms);
+    }
+};
+} // namespace sleeper_test
+
+namespace stats_test
+{
+using namespace std::chrono_literals;
+
+struct ChildTask final : public Task
+{
+    ChildTask() : Task("ChildTask") {}
+    StepResult step(Executor &executor) override
+    {
+        return step_result::Done();
+    }
+};
+
+struct ParentTask final : public Task
+{
+    bool has_spawned = false;
+    ParentTask() : Task("ParentTask") {}
+    StepResult step(Executor &executor) override
+    {
+        if (has_spawned)
+            return step_result::Done();
+        has_spawned = true;
+        std::vector<std::unique_ptr<Task>> children;
+        for (int i = 0; i < 10; ++i)
+            children.push_back(std::make_unique<ChildTask>());
+        return step_result::Wait(step_result::Wait::task_not_done,
+                                 std::move(children));
+    }
+};
+
+// Alone in the queue, so it should never wait long to be stepped again
+struct SlowTask final : public Task
+{
+    unsigned steps_left = 10;
+    SlowTask() : Task("SlowTask") {}
+    StepResult step(Executor &executor) override
+    {
+        std::this_thread::sleep_for(2ms);
+        if (--steps_left == 0)
+            return step_result::Done();
+        return step_result::Ready();
+    }
+};
+} // namespace stats_test
+
+namespace mutex_fairness_test
+{
+struct LockerTask;
+struct LockerTaskPromiseType final
+    : PromiseType<LockerTaskPromiseType, LockerTask>
+{
+    static std::string_view get_name() { return "LockerTask"; }
+};
+struct LockerTask final : public CoroutineTask<LockerTaskPromiseType>
+{
+    LockerTask(std::string_view name, promise_type &promise)
+        : CoroutineTask(name, promise)
+    {
+    }
+};
+
+bool holder_unlocked = false;
+
+std::unique_ptr<LockerTask> holder_task(Mutex &mutex)
+{
+    co_await mutex.lock();
+    // The waiters park behind us
+    co_yield step_result::Ready();
+    mutex.unlock(co_await executor_awaiter);
+    holder_unlocked = true;
+}
+
+// Takes the mutex between the unlock and the woken waiter's step
+std::unique_ptr<LockerTask> barging_task(Mutex &mutex)
+{
+    while (not holder_unlocked)
+        co_yield step_result::Ready();
+    co_await mutex.lock();
+    co_yield step_result::Ready();
+    mutex.unlock(co_await executor_awaiter);
+}
+
+std::unique_ptr<LockerTask> waiter_task(Mutex &mutex, char const *name)
+{
+    co_await mutex.lock();
+    std::cerr << "Acquired by " << name << '\n';
+    mutex.unlock(co_await executor_awaiter);
+}
+} // namespace mutex_fairness_test
+
+namespace mutex_cancellation_test
+{
+using namespace std::chrono_literals;
+using mutex_fairness_test::LockerTask;
+using mutex_fairness_test::waiter_task;
+
+// Unlocks, which wakes the first waiter, and cancels it before it runs
+std::unique_ptr<LockerTask> cancelling_holder_task(Mutex &mutex,
+                                                   Rc<CancellationToken> token)
+{
+    Executor &executor = co_await executor_awaiter;
+    Mutex::Guard guard = co_await mutex.lock(executor);
+    co_yield step_result::Ready();
+    guard.unlock();
+    executor.cancel(*token);
+}
+
+// Holds the mutex until it is cancelled
+std::unique_ptr<LockerTask> sleeping_holder_task(Mutex &mutex)
+{
+    Mutex::Guard guard = co_await mutex.lock(co_await executor_awaiter);
+    co_yield step_result::sleep_for(1h);
+}
+
+std::unique_ptr<LockerTask> canceller_task(Rc<CancellationToken> token)
+{
+    // The holder and the waiter get to run first
+    co_yield step_result::Ready();
+    (co_await executor_awaiter).cancel(*token);
+}
+} // namespace mutex_cancellation_test
+
+namespace many_subtasks_test
+{
+using namespace std::chrono_literals;
+
+std::vector<size_t> finished;
+
+// Sleeps for longer the lower its index, so the subtasks finish in reverse
+// and wake the group from every word of its ready mask
+struct SleepOnceTask final : public Task
+{
+    size_t index;
+    bool slept = false;
+    SleepOnceTask(size_t index) : Task("SleepOnceTask"), index(index) {}
+    StepResult step(Executor &executor) override
+    {
+        if (not std::exchange(slept, true))
+            return step_result::sleep_for(1ms * (100 - index));
+        finished.push_back(index);
+        return step_result::Done();
+    }
+};
+
+template <size_t... Indices>
+auto make_group(std::index_sequence<Indices...>)
+{
+    return make_independent_tasks(SleepOnceTask(Indices)...);
+}
+} // namespace many_subtasks_test
+
+namespace io_priority_test
+{
+size_t busy_steps = 0;
+
+struct BusyTask final : public Task
+{
+    size_t remaining;
+    BusyTask(size_t steps) : Task("BusyTask"), remaining(steps) {}
+    StepResult step(Executor &executor) override
+    {
+        ++busy_steps;
+        if (--remaining == 0)
+            return step_result::Done();
+        return step_result::Ready();
+    }
+};
+
+struct ReaderTask;
+struct ReaderTaskPromiseType final
+    : PromiseType<ReaderTaskPromiseType, ReaderTask>
+{
+    static std::string_view get_name() { return "ReaderTask"; }
+};
+struct ReaderTask final : public CoroutineTask<ReaderTaskPromiseType>
+{
+    ReaderTask(std::string_view name, promise_type &promise)
+        : CoroutineTask(name, promise)
+    {
+    }
+};
+
+// Background work whose read completes while normal work is queued
+std::unique_ptr<ReaderTask> reader_task(IoUringTask &ring, int fd)
+{
+    std::array<std::byte, 16> buf;
+    size_t const busy_steps_before = busy_steps;
+    co_await ring.read(fd, buf);
+    // The ring reaps the completion in its next step, and the continuation
+    // runs straight after it
+    std::cerr << "Busy steps before the I/O continuation: "
+              << busy_steps - busy_steps_before << '\n';
+    ring.stop();
+}
+} // namespace io_priority_test
+
 void test0()
 {
     using namespace queue_test;
@@ -818,7 +1423,7 @@ void test2()
 {
     using namespace queue_coroutine_test;
     SingleThreadedExecutor executor;
-    auto task = main_task();
+    auto task = main_task<false>();
     executor.add_task(std::move(task));
     executor.run_until_completion();
 }
@@ -839,9 +1444,300 @@ void test4()
     executor.run_until_completion();
 }
 
+void test5()
+{
+    using namespace rc_queue_test;
+    WorkStealingExecutor executor(4);
+    for (int i = 0; i < 8; ++i)
+        executor.add_task(std::make_unique<MainTask>());
+    executor.run_until_completion();
+}
+
+void test6()
+{
+    using namespace timer_test;
+    SingleThreadedExecutor executor;
+    executor.add_task(main_task());
+    executor.run_until_completion();
+}
+
+void test7()
+{
+    using namespace io_uring_test;
+    SingleThreadedExecutor executor;
+    auto ring = std::make_unique<IoUringTask>();
+    IoUringTask &ring_ref = *ring;
+    executor.add_task(std::move(ring));
+    int fds[2];
+    if (pipe(fds) == -1)
+        throw std::runtime_error("pipe failed");
+    auto reader = blocked_read_task(ring_ref, fds[0]);
+    Rc<CancellationToken> reader_token = Rc<CancellationToken>::create();
+    reader->set_cancellation_token(reader_token);
+    executor.add_task(std::move(reader));
+    executor.add_task(main_task(ring_ref, std::move(reader_token)));
+    executor.run_until_completion();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test8()
+{
+    using namespace async_socket_test;
+    int const listening_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_length = sizeof(address);
+    if (bind(listening_fd, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) == -1 or
+        listen(listening_fd, 1) == -1 or
+        getsockname(listening_fd, reinterpret_cast<sockaddr *>(&address),
+                    &address_length) == -1)
+        throw std::runtime_error("Could not listen on loopback");
+    SingleThreadedExecutor executor;
+    executor.add_task(echo_server(listening_fd));
+    executor.add_task(client(address));
+    executor.run_until_completion();
+}
+
+void test9()
+{
+    using namespace rc_queue_test;
+    SingleThreadedExecutor executor;
+    executor.enable_stats();
+    executor.add_task(std::make_unique<MainTask>());
+    executor.run_until_completion();
+    SingleThreadedExecutor::Stats const &stats = *executor.get_stats();
+    std::cerr << "Steps: " << stats.steps
+              << ", tasks added: " << stats.tasks_added
+              << ", sleeping: " << stats.sleeping_tasks << '\n';
+    std::vector<std::pair<std::string, uint64_t>> steps_by_name;
+    for (auto const &[name, histogram] : stats.step_time_by_task_name)
+        steps_by_name.emplace_back(name, histogram.count);
+    std::sort(steps_by_name.begin(), steps_by_name.end());
+    for (auto const &[name, count] : steps_by_name)
+        std::cerr << name << ": " << count << " steps\n";
+}
+
+void test10()
+{
+    using namespace rc_queue_test;
+    SingleThreadedExecutor executor;
+    executor.enable_tracing();
+    executor.add_task(std::make_unique<MainTask>());
+    executor.run_until_completion();
+    TraceBuffer const &trace = *executor.get_trace();
+    std::cerr << "Trace events: " << trace.size() << '\n';
+    // Loadable in chrome://tracing or ui.perfetto.dev
+    std::ostringstream json;
+    trace.write_chrome_json(json);
+    std::string const text = json.str();
+    size_t steps = 0;
+    for (size_t i = 0; (i = text.find("\"ph\":\"X\"", i)) != text.npos; ++i)
+        ++steps;
+    std::cerr << "Traced steps: " << steps << '\n';
+
+    // A task first traced by another buffer, as when a worker steals it,
+    // keeps its id but has its name registered with this buffer too
+    stats_test::ChildTask task;
+    TraceBuffer first;
+    TraceBuffer second;
+    first.record(TraceBuffer::EventType::spawn, task);
+    second.record(TraceBuffer::EventType::step, task);
+    std::ostringstream second_json;
+    second.write_chrome_json(second_json);
+    std::cerr << "Named in the second buffer: "
+              << (second_json.str().find("ChildTask #") != std::string::npos)
+              << '\n';
+}
+
+void test11()
+{
+    using namespace cancellation_test;
+    SingleThreadedExecutor executor;
+    Rc<CancellationToken> token = Rc<CancellationToken>::create();
+    auto parent = std::make_unique<ParentTask>();
+    parent->set_cancellation_token(token);
+    auto timer = std::make_unique<TimerTask>();
+    timer->set_cancellation_token(Rc<CancellationToken>::create(token));
+    executor.add_task(std::move(parent));
+    executor.add_task(std::move(timer));
+    // The parent, four children and the timer
+    executor.add_task(std::make_unique<CancelTask>(token, 6));
+    executor.run_until_completion();
+    std::cerr << "Live tasks: " << live_tasks << '\n';
+
+    // A subtask with a token of its own is cancelled while it sleeps, and its
+    // group finishes without it
+    FifoWaker waker;
+    Rc<CancellationToken> subtask_token = Rc<CancellationToken>::create();
+    {
+        SleepForeverTask subtask(waker);
+        subtask.set_cancellation_token(subtask_token);
+        executor.add_task(make_independent_tasks(std::move(subtask)));
+    }
+    sleeping_tasks = 0;
+    executor.add_task(std::make_unique<CancelTask>(subtask_token, 1));
+    executor.run_until_completion();
+    std::cerr << "Live tasks: " << live_tasks << '\n';
+}
+
+void test12()
+{
+    using namespace priority_test;
+    SingleThreadedExecutor executor;
+    auto latency_critical = std::make_unique<BusyTask>(100);
+    latency_critical->set_priority(Priority::latency_critical);
+    executor.add_task(std::make_unique<BusyTask>(100));
+    executor.add_task(std::make_unique<BackgroundParentTask>());
+    executor.add_task(std::move(latency_critical));
+    executor.run_until_completion();
+    // Each round has 16 latency-critical, 4 normal and 1 background steps.
+    // The background parent takes the first round's background step.
+    std::cerr << "Latency-critical: " << steps_by_priority[0]
+              << ", normal: " << steps_by_priority[1]
+              << ", background: " << steps_by_priority[2] << '\n';
+}
+
+void test13()
+{
+    using namespace std::chrono_literals;
+    using namespace step_budget_test;
+    SingleThreadedExecutor executor;
+    executor.set_step_budget(16);
+    executor.add_task(std::make_unique<HogTask>(100));
+    executor.add_task(std::make_unique<OtherTask>());
+    if (executor.run_batch(10) == ExecutorStepResult::more_to_go)
+        std::cerr << "Batch stopped after " << steps << " steps\n";
+    if (executor.run_for(10s) == ExecutorStepResult::done)
+        std::cerr << "Done after " << steps << " steps\n";
+}
+
+void test14()
+{
+    using namespace sleeper_test;
+    // A worker whose tasks all sleep must still start the queued ones, so
+    // the sleeps overlap however many workers there are
+    for (size_t number_of_workers : {1, 4})
+    {
+        WorkStealingExecutor executor(number_of_workers);
+        for (int i = 0; i < 20; ++i)
+            executor.add_task(std::make_unique<SleeperTask>());
+        auto const start = Clock::now();
+        executor.run_until_completion();
+        std::cerr << number_of_workers << " workers slept about once: "
+                  << (Clock::now() - start < 100ms) << '\n';
+    }
+}
+
+void test15()
+{
+    using namespace std::chrono_literals;
+    using namespace stats_test;
+    SingleThreadedExecutor executor;
+    executor.enable_stats();
+    executor.add_task(std::make_unique<ParentTask>());
+    executor.run_until_completion();
+    // The parent and its 10 children are spawned, and the last child wakes
+    // the parent
+    std::cerr << "Spawned: " << executor.get_stats()->tasks_added
+              << ", woken: " << executor.get_stats()->tasks_woken << '\n';
+
+    executor.enable_stats();
+    executor.add_task(std::make_unique<SlowTask>());
+    executor.run_until_completion();
+    // Counted from when the task was last queued, not first queued
+    std::cerr << "Queue latency under a step: "
+              << (executor.get_stats()->queue_latency.max <
+                  static_cast<uint64_t>(std::chrono::nanoseconds(2ms).count()))
+              << '\n';
+}
+
+void test16()
+{
+    using namespace io_priority_test;
+    SingleThreadedExecutor executor;
+    auto ring = std::make_unique<IoUringTask>();
+    IoUringTask &ring_ref = *ring;
+    int fds[2];
+    if (pipe(fds) == -1 or write(fds[1], "x", 1) != 1)
+        throw std::runtime_error("pipe failed");
+    auto reader = reader_task(ring_ref, fds[0]);
+    reader->set_priority(Priority::background);
+    executor.add_task(std::move(ring));
+    executor.add_task(std::make_unique<BusyTask>(100));
+    executor.add_task(std::move(reader));
+    executor.run_until_completion();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test17()
+{
+    using namespace queue_coroutine_test;
+    SingleThreadedExecutor executor;
+    executor.add_task(main_task<true>());
+    executor.run_until_completion();
+}
+
+void test18()
+{
+    using namespace mutex_fairness_test;
+    // The first waiter loses its wake-up to the barging task, and must still
+    // go before the second
+    SingleThreadedExecutor executor;
+    Mutex mutex;
+    executor.add_task(holder_task(mutex));
+    executor.add_task(waiter_task(mutex, "first waiter"));
+    executor.add_task(waiter_task(mutex, "second waiter"));
+    executor.add_task(barging_task(mutex));
+    executor.run_until_completion();
+}
+
+void test19()
+{
+    using namespace mutex_cancellation_test;
+    {
+        SingleThreadedExecutor executor;
+        Mutex mutex;
+        Rc<CancellationToken> token = Rc<CancellationToken>::create();
+        auto cancelled = waiter_task(mutex, "cancelled waiter");
+        cancelled->set_cancellation_token(token);
+        executor.add_task(cancelling_holder_task(mutex, token));
+        executor.add_task(std::move(cancelled));
+        executor.add_task(waiter_task(mutex, "waiter behind it"));
+        executor.run_until_completion();
+    }
+    {
+        SingleThreadedExecutor executor;
+        Mutex mutex;
+        Rc<CancellationToken> token = Rc<CancellationToken>::create();
+        auto holder = sleeping_holder_task(mutex);
+        holder->set_cancellation_token(token);
+        executor.add_task(std::move(holder));
+        executor.add_task(waiter_task(mutex, "waiter on a cancelled holder"));
+        executor.add_task(canceller_task(token));
+        executor.run_until_completion();
+    }
+}
+
+void test20()
+{
+    using namespace many_subtasks_test;
+    // More subtasks than fit in one 64-bit word of the ready mask
+    SingleThreadedExecutor executor;
+    executor.add_task(make_group(std::make_index_sequence<70>()));
+    executor.run_until_completion();
+    std::cerr << "Finished " << finished.size() << " subtasks, first "
+              << finished.front() << ", last " << finished.back() << '\n';
+}
+
 int main(int argc, char const **argv)
 {
-    std::array tests{test0, test1, test2, test3, test4};
+    std::array tests{test0,  test1,  test2,  test3,  test4,  test5,  test6,
+                     test7,  test8,  test9,  test10, test11, test12, test13,
+                     test14, test15, test16, test17, test18, test19, test20};
     if (argc < 2)
     {
         fprintf(stderr, "Usage: %s <test_number>\n", program_invocation_name);
@@ -7,7 +7,7 @@ concept DecaysTo = std::same_as<std::decay_t<U>, T>;
 
 struct TypeErasedDeleter
 {
-    void (*const deleter)(void *);
+    void (*deleter)(void *);
     TypeErasedDeleter() : deleter() {}
 
     TypeErasedDeleter(void (*deleter)(void *)) : deleter(deleter) {}